@@ -0,0 +1,21 @@
+@echo off
+setlocal enableextensions enabledelayedexpansion
+
+rem Builds the bench configuration and runs every script in bench\ with and
+rem without constant folding. Results are written to bin\bench.jsonl, one JSON
+rem object per run. Pass a number to change how many times each script runs.
+
+set runs=20
+if not "%1"=="" set runs=%1
+
+call build bench
+
+set results=bin\bench.jsonl
+if exist !results! del !results!
+
+for %%f in (bench\*.lox) do (
+	bin\lox.exe --bench !runs! %%f >nul 2>>!results!
+	bin\lox.exe --no-fold --bench !runs! %%f >nul 2>>!results!
+)
+
+type !results!
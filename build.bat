@@ -5,7 +5,7 @@ set configuration=debug
 set platform=LOX_PLATFORM_WINDOWS
 set compileflags=-std=c99 -D!platform!=1 -I../src
 set linkflags=
-set source=../src/main.c ../src/chunk.c ../src/memory.c ../src/debug.c ../src/value.c ../src/vm.c ../src/compiler.c ../src/scanner.c ../src/object.c ../src/table.c
+set source=../src/main.c ../src/chunk.c ../src/memory.c ../src/debug.c ../src/value.c ../src/vm.c ../src/compiler.c ../src/scanner.c ../src/object.c ../src/table.c ../src/timer.c ../src/trace.c ../src/cache.c ../src/mapfile.c ../src/pool.c ../src/profile.c ../src/jit.c
 if not exist bin mkdir bin
 
 for %%a in (%*) do (
@@ -13,11 +13,27 @@ for %%a in (%*) do (
 		set configuration=debug
 	) else if "%%a"=="release" (
 		set configuration=release
+	) else if "%%a"=="bench" (
+		set configuration=bench
+	) else if "%%a"=="profile" (
+		set configuration=profile
+	) else if "%%a"=="jit" (
+		set configuration=jit
+	) else if "%%a"=="test" (
+		set configuration=test
 	)
 )
 
 if "%configuration%"=="release" (
-	set compileflags=!compileflags! -O2 -mwindows /DLOX_RELEASE_BUILD=1
+	set compileflags=!compileflags! -O2 -mwindows -DLOX_RELEASE_BUILD=1
+) else if "%configuration%"=="bench" (
+	set compileflags=!compileflags! -O2 -DLOX_RELEASE_BUILD=1 -DLOX_BENCH=1
+) else if "%configuration%"=="profile" (
+	set compileflags=!compileflags! -O2 -DLOX_RELEASE_BUILD=1 -DLOX_PROFILE=1
+) else if "%configuration%"=="jit" (
+	set compileflags=!compileflags! -O2 -DLOX_RELEASE_BUILD=1 -DLOX_JIT=1
+) else if "%configuration%"=="test" (
+	set compileflags=!compileflags! -g -Wall -DLOX_JIT=1
 ) else (
 	set compileflags=!compileflags! -g -Wall
 )
@@ -0,0 +1,454 @@
+#if !defined(LOX_PLATFORM_WINDOWS)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(LOX_PLATFORM_WINDOWS)
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "cache.h"
+#include "compiler.h"
+#include "mapfile.h"
+#include "object.h"
+#include "vm.h"
+
+// File layout, all integers little endian:
+//
+//   "LOXC" u32 version  u32 opcodeCount  u64 key  u32 maxStack  u64 payloadHash
+//   u32 lineCount  (u32 offset  u32 line)[lineCount]
+//   u32 codeCount  u8 code[codeCount]
+//   u32 constantCount  constants[constantCount]
+//
+// Each constant is a u8 tag followed by a 64-bit IEEE double for numbers, or a
+// u32 length and the characters for strings. The payload is everything after
+// payloadHash, up to the end of the file.
+
+#define CACHE_MAGIC "LOXC"
+
+typedef enum {
+	CONSTANT_NUMBER,
+	CONSTANT_STRING,
+} ConstantTag;
+
+#define FNV_OFFSET_BASIS 14695981039346656037u
+#define FNV_PRIME 1099511628211u
+
+// Cursor over a cache file mapped into memory.
+typedef struct {
+	const uint8_t * current;
+	const uint8_t * end;
+} Reader;
+
+// A cache file being written, and the FNV-1a hash of what went into it.
+typedef struct {
+	FILE * file;
+	uint64_t hash;
+} Writer;
+
+
+static uint64_t hashBytes(uint64_t hash, const uint8_t * bytes, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+uint64_t hashSource(const char * source)
+{
+	return hashBytes(FNV_OFFSET_BASIS, (const uint8_t *)source, strlen(source));
+}
+
+uint64_t cacheKey(const char * source, bool foldConstants)
+{
+	uint8_t options = foldConstants ? 1 : 0;
+	return hashBytes(hashSource(source), &options, 1);
+}
+
+static void writeBytes(Writer * writer, const void * bytes, size_t count)
+{
+	fwrite(bytes, 1, count, writer->file);
+	writer->hash = hashBytes(writer->hash, (const uint8_t *)bytes, count);
+}
+
+static void writeU32(Writer * writer, uint32_t value)
+{
+	uint8_t bytes[4];
+	for (int i = 0; i < 4; i++)
+		bytes[i] = (uint8_t)(value >> (i * 8));
+	writeBytes(writer, bytes, sizeof(bytes));
+}
+
+static void writeU64(Writer * writer, uint64_t value)
+{
+	writeU32(writer, (uint32_t)value);
+	writeU32(writer, (uint32_t)(value >> 32));
+}
+
+static const uint8_t * readBytes(Reader * reader, size_t count)
+{
+	if ((size_t)(reader->end - reader->current) < count)
+		return NULL;
+
+	const uint8_t * bytes = reader->current;
+	reader->current += count;
+	return bytes;
+}
+
+static bool readU32(Reader * reader, uint32_t * value)
+{
+	const uint8_t * bytes = readBytes(reader, 4);
+	if (bytes == NULL)
+		return false;
+
+	*value = 0;
+	for (int i = 0; i < 4; i++)
+		*value |= (uint32_t)bytes[i] << (i * 8);
+	return true;
+}
+
+static bool readU64(Reader * reader, uint64_t * value)
+{
+	uint32_t low, high;
+	if (!readU32(reader, &low) || !readU32(reader, &high))
+		return false;
+
+	*value = ((uint64_t)high << 32) | low;
+	return true;
+}
+
+static bool writeConstant(Writer * writer, Value value)
+{
+	if (IS_NUMBER(value))
+	{
+		double number = AS_NUMBER(value);
+		uint64_t bits;
+		memcpy(&bits, &number, sizeof(bits));
+
+		uint8_t tag = CONSTANT_NUMBER;
+		writeBytes(writer, &tag, 1);
+		writeU64(writer, bits);
+		return true;
+	}
+
+	if (IS_STRING(value))
+	{
+		ObjString * string = AS_STRING(value);
+		uint8_t tag = CONSTANT_STRING;
+		writeBytes(writer, &tag, 1);
+		writeU32(writer, (uint32_t)string->length);
+		writeBytes(writer, string->chars, string->length);
+		return true;
+	}
+
+	return false;
+}
+
+static bool readConstant(Reader * reader, Chunk * chunk)
+{
+	const uint8_t * tag = readBytes(reader, 1);
+	if (tag == NULL)
+		return false;
+
+	if (*tag == CONSTANT_NUMBER)
+	{
+		uint64_t bits;
+		if (!readU64(reader, &bits))
+			return false;
+
+		double number;
+		memcpy(&number, &bits, sizeof(number));
+		addConstant(chunk, NUMBER_VAL(number));
+		return true;
+	}
+
+	if (*tag == CONSTANT_STRING)
+	{
+		uint32_t length;
+		if (!readU32(reader, &length))
+			return false;
+
+		// Strings are copied straight out of the mapping.
+		const uint8_t * chars = readBytes(reader, length);
+		if (chars == NULL)
+			return false;
+
+		addConstant(chunk, OBJ_VAL(copyString((const char *)chars, (int)length)));
+		return true;
+	}
+
+	return false;
+}
+
+static const uint8_t instructionLengths[OP_COUNT] = {
+#define OPCODE_LENGTH(name, length, stackEffect) length,
+	OPCODE_LIST(OPCODE_LENGTH)
+#undef OPCODE_LENGTH
+};
+
+static const int stackEffects[OP_COUNT] = {
+#define OPCODE_EFFECT(name, length, stackEffect) stackEffect,
+	OPCODE_LIST(OPCODE_EFFECT)
+#undef OPCODE_EFFECT
+};
+
+// The line runs must start at the first instruction and move strictly forward
+// through the code, so every offset has exactly one line.
+static bool verifyLines(const uint8_t * lines, uint32_t lineCount, uint32_t codeCount)
+{
+	if ((lineCount == 0) != (codeCount == 0))
+		return false;
+
+	Reader reader = { lines, lines + (size_t)lineCount * 8 };
+	uint32_t previous = 0;
+
+	for (uint32_t i = 0; i < lineCount; i++)
+	{
+		uint32_t offset = 0;
+		readU32(&reader, &offset);
+		readBytes(&reader, 4);
+
+		if (offset >= codeCount || (i == 0 ? offset != 0 : offset <= previous))
+			return false;
+
+		previous = offset;
+	}
+
+	return true;
+}
+
+// Walks the code once the way run() would. Unknown opcodes, operands running
+// off the end, constants the pool does not hold, stack underflow or a deeper
+// stack than maxStack, and code that does not end in OP_RETURN all reject the
+// cache. On success maxStack is trimmed to what the code needs.
+static bool verifyCode(Chunk * chunk)
+{
+	int depth = 0, maxDepth = 0;
+	uint8_t op = OP_COUNT;
+
+	for (int offset = 0; offset < chunk->count; offset += instructionLengths[op])
+	{
+		op = chunk->code[offset];
+		if (op >= OP_COUNT || chunk->count - offset < instructionLengths[op])
+			return false;
+
+		if (op == OP_CONSTANT || op == OP_CONSTANT_LONG)
+		{
+			const uint8_t * operand = &chunk->code[offset + 1];
+			int index = op == OP_CONSTANT ? operand[0] :
+				(operand[0] << 16) | (operand[1] << 8) | operand[2];
+
+			if (index >= chunk->constants.count)
+				return false;
+		}
+
+		// Everything but OP_RETURN leaves a result behind, so no instruction
+		// may consume more values than are on the stack.
+		depth += stackEffects[op];
+		if (depth < (op == OP_RETURN ? 0 : 1) || depth > chunk->maxStack)
+			return false;
+
+		if (depth > maxDepth)
+			maxDepth = depth;
+	}
+
+	if (op != OP_RETURN)
+		return false;
+
+	chunk->maxStack = maxDepth;
+	return true;
+}
+
+static bool readChunk(Reader * reader, uint64_t key, Chunk * chunk)
+{
+	const uint8_t * magic = readBytes(reader, 4);
+	uint32_t version, opcodeCount;
+	uint64_t hash;
+
+	if (magic == NULL || memcmp(magic, CACHE_MAGIC, 4) != 0)
+		return false;
+
+	if (!readU32(reader, &version) || version != CACHE_VERSION ||
+		!readU32(reader, &opcodeCount) || opcodeCount != OP_COUNT ||
+		!readU64(reader, &hash) || hash != key)
+		return false;
+
+	uint32_t maxStack;
+	if (!readU32(reader, &maxStack) || maxStack > INT_MAX)
+		return false;
+
+	// Corruption that still makes a well formed chunk would run as a different
+	// program, only the hash tells it apart.
+	uint64_t payloadHash;
+	if (!readU64(reader, &payloadHash) ||
+		hashBytes(FNV_OFFSET_BASIS, reader->current, (size_t)(reader->end - reader->current)) != payloadHash)
+		return false;
+
+	chunk->maxStack = (int)maxStack;
+
+	uint32_t lineCount;
+	if (!readU32(reader, &lineCount))
+		return false;
+
+	const uint8_t * lines = readBytes(reader, (size_t)lineCount * 8);
+	if (lines == NULL)
+		return false;
+
+	uint32_t codeCount;
+	if (!readU32(reader, &codeCount) || codeCount > INT_MAX)
+		return false;
+
+	const uint8_t * code = readBytes(reader, codeCount);
+	if (code == NULL || !verifyLines(lines, lineCount, codeCount))
+		return false;
+
+	// Replay the code through writeChunk() so the line runs are rebuilt as
+	// they were when the chunk was compiled.
+	Reader lineReader = { lines, lines + (size_t)lineCount * 8 };
+	uint32_t nextOffset = 0, nextLine = 0;
+	int line = 0;
+
+	if (lineCount > 0)
+	{
+		readU32(&lineReader, &nextOffset);
+		readU32(&lineReader, &nextLine);
+	}
+
+	for (uint32_t i = 0; i < codeCount; i++)
+	{
+		while (lineCount > 0 && nextOffset <= i)
+		{
+			line = (int)nextLine;
+			lineCount--;
+			if (lineCount > 0)
+			{
+				readU32(&lineReader, &nextOffset);
+				readU32(&lineReader, &nextLine);
+			}
+		}
+
+		writeChunk(chunk, code[i], line);
+	}
+
+	uint32_t constantCount;
+	if (!readU32(reader, &constantCount) || constantCount > MAX_CONSTANTS)
+		return false;
+
+	for (uint32_t i = 0; i < constantCount; i++)
+	{
+		if (!readConstant(reader, chunk))
+			return false;
+	}
+
+	return verifyCode(chunk);
+}
+
+bool loadChunk(const char * path, uint64_t key, Chunk * chunk)
+{
+	MappedFile file;
+	if (!openMappedFile(path, &file))
+		return false;
+
+	Reader reader;
+	reader.current = (const uint8_t *)file.data;
+	reader.end = reader.current + file.size;
+
+	// The strings read from the cache are only referenced by the chunk, so it
+	// has to be visible to the collector while it is being filled in.
+	vm->chunk = chunk;
+	bool loaded = readChunk(&reader, key, chunk);
+	vm->chunk = NULL;
+
+	closeMappedFile(&file);
+
+	if (!loaded)
+		freeChunk(chunk);
+#ifdef LOX_REGISTER_VM
+	else
+		allocateRegisters(chunk);
+#endif
+
+	return loaded;
+}
+
+// Moves the finished temporary file over the cache. Readers holding the old
+// file open or mapped keep seeing it whole, and new ones the whole new file.
+static bool replaceFile(const char * from, const char * to)
+{
+#if defined(LOX_PLATFORM_WINDOWS)
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from, to) == 0;
+#endif
+}
+
+bool saveChunk(const char * path, uint64_t key, Chunk * chunk)
+{
+	// The temporary file sits next to the cache so the final rename never
+	// crosses file systems. The process and VM make its name unique to this
+	// writer.
+	char tempPath[4096];
+	int length = snprintf(tempPath, sizeof(tempPath), "%s.%ld.%lx.tmp", path,
+		(long)getpid(), (unsigned long)(uintptr_t)vm);
+	if (length < 0 || (size_t)length >= sizeof(tempPath))
+		return false;
+
+	Writer writer = { fopen(tempPath, "wb"), FNV_OFFSET_BASIS };
+	if (writer.file == NULL)
+		return false;
+
+	writeBytes(&writer, CACHE_MAGIC, 4);
+	writeU32(&writer, CACHE_VERSION);
+	writeU32(&writer, OP_COUNT);
+	writeU64(&writer, key);
+	writeU32(&writer, (uint32_t)chunk->maxStack);
+
+	// Leave room for the payload hash, which is filled in at the end.
+	long payloadHashOffset = ftell(writer.file);
+	writeU64(&writer, 0);
+	writer.hash = FNV_OFFSET_BASIS;
+
+	writeU32(&writer, (uint32_t)chunk->lineCount);
+	for (int i = 0; i < chunk->lineCount; i++)
+	{
+		writeU32(&writer, (uint32_t)chunk->lines[i].offset);
+		writeU32(&writer, (uint32_t)chunk->lines[i].line);
+	}
+
+	writeU32(&writer, (uint32_t)chunk->count);
+	writeBytes(&writer, chunk->code, chunk->count);
+
+	bool ok = true;
+	writeU32(&writer, (uint32_t)chunk->constants.count);
+	for (int i = 0; i < chunk->constants.count && ok; i++)
+		ok = writeConstant(&writer, chunk->constants.values[i]);
+
+	uint64_t payloadHash = writer.hash;
+	ok = ok && payloadHashOffset >= 0 && fseek(writer.file, payloadHashOffset, SEEK_SET) == 0;
+	if (ok)
+		writeU64(&writer, payloadHash);
+
+	ok = !ferror(writer.file) && ok;
+	if (fclose(writer.file) != 0)
+		ok = false;
+
+	ok = ok && replaceFile(tempPath, path);
+
+	// Never leave a half written cache behind.
+	if (!ok)
+		remove(tempPath);
+
+	return ok;
+}
@@ -0,0 +1,19 @@
+#ifndef LOX_CACHE_H
+#define LOX_CACHE_H
+
+#include "chunk.h"
+
+
+// Bytecode cache files hold a compiled chunk together with the key of the
+// source it came from. Bump CACHE_VERSION whenever the layout changes.
+#define CACHE_VERSION 5
+
+uint64_t hashSource(const char * source);
+// The hash of source mixed with every compile option that changes the code
+// it compiles to, so a cache is only used by runs that would compile the same.
+uint64_t cacheKey(const char * source, bool foldConstants);
+
+bool loadChunk(const char * path, uint64_t key, Chunk * chunk);
+bool saveChunk(const char * path, uint64_t key, Chunk * chunk);
+
+#endif
@@ -1,24 +1,65 @@
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
+#ifdef LOX_JIT
+#include "jit.h"
+#endif
+#include "object.h"
+#include "vm.h"
 
 
 void initChunk(Chunk * chunk)
+{
+	initChunkInArena(chunk, NULL);
+}
+
+void initChunkInArena(Chunk * chunk, Arena * arena)
 {
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
+	chunk->lineCount = 0;
+	chunk->lineCapacity = 0;
 	chunk->lines = NULL;
-	initValueArray(&chunk->constants);
+	chunk->indexCapacity = 0;
+	chunk->indexUsed = 0;
+	chunk->constantIndex = NULL;
+	chunk->maxStack = 0;
+	chunk->readOnly = false;
+#ifdef LOX_REGISTER_VM
+	chunk->registerCodeCount = 0;
+	chunk->registerCodeCapacity = 0;
+	chunk->registerCode = NULL;
+	chunk->frameSize = 0;
+	chunk->frameConstantCount = 0;
+	chunk->frameConstantCapacity = 0;
+	chunk->frameConstants = NULL;
+#endif
+#ifdef LOX_JIT
+	chunk->runs = 0;
+	chunk->native = NULL;
+	chunk->nativeSize = 0;
+#endif
+	chunk->arena = arena;
+	initValueArrayInArena(&chunk->constants, arena);
 }
 
 void freeChunk(Chunk * chunk)
 {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	ARENA_FREE_ARRAY(chunk->arena, uint8_t, chunk->code, chunk->capacity, MEM_CODE);
+	ARENA_FREE_ARRAY(chunk->arena, LineStart, chunk->lines, chunk->lineCapacity, MEM_LINES);
+	ARENA_FREE_ARRAY(chunk->arena, int, chunk->constantIndex, chunk->indexCapacity, MEM_CONSTANTS);
+#ifdef LOX_REGISTER_VM
+	ARENA_FREE_ARRAY(chunk->arena, RegisterInstruction, chunk->registerCode, chunk->registerCodeCapacity, MEM_CODE);
+	ARENA_FREE_ARRAY(chunk->arena, int, chunk->frameConstants, chunk->frameConstantCapacity, MEM_CODE);
+#endif
+#ifdef LOX_JIT
+	freeNative(chunk);
+#endif
 	freeValueArray(&chunk->constants);
-	initChunk(chunk);
+	initChunkInArena(chunk, chunk->arena);
 }
 
 void writeChunk(Chunk * chunk, uint8_t byte, int line)
@@ -27,17 +68,225 @@ void writeChunk(Chunk * chunk, uint8_t byte, int line)
 	{
 		int oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
-		chunk->code = GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
-		chunk->lines = GROW_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity);
+		chunk->code = ARENA_GROW_ARRAY(chunk->arena, chunk->code, uint8_t, oldCapacity, chunk->capacity, MEM_CODE);
 	}
 
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;
 	chunk->count++;
+
+	if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+		return;
+
+	if (chunk->lineCapacity < chunk->lineCount + 1)
+	{
+		int oldCapacity = chunk->lineCapacity;
+		chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->lines = ARENA_GROW_ARRAY(chunk->arena, chunk->lines, LineStart, oldCapacity, chunk->lineCapacity, MEM_LINES);
+	}
+
+	LineStart * lineStart = &chunk->lines[chunk->lineCount++];
+	lineStart->offset = chunk->count - 1;
+	lineStart->line = line;
+}
+
+#ifdef LOX_REGISTER_VM
+void writeRegisterCode(Chunk * chunk, RegisterInstruction instruction)
+{
+	if (chunk->registerCodeCapacity < chunk->registerCodeCount + 1)
+	{
+		int oldCapacity = chunk->registerCodeCapacity;
+		chunk->registerCodeCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->registerCode = ARENA_GROW_ARRAY(chunk->arena, chunk->registerCode, RegisterInstruction, oldCapacity, chunk->registerCodeCapacity, MEM_CODE);
+	}
+
+	chunk->registerCode[chunk->registerCodeCount++] = instruction;
+}
+
+int writeFrameConstant(Chunk * chunk, int constant)
+{
+	if (chunk->frameConstantCapacity < chunk->frameConstantCount + 1)
+	{
+		int oldCapacity = chunk->frameConstantCapacity;
+		chunk->frameConstantCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->frameConstants = ARENA_GROW_ARRAY(chunk->arena, chunk->frameConstants, int, oldCapacity, chunk->frameConstantCapacity, MEM_CODE);
+	}
+
+	chunk->frameConstants[chunk->frameConstantCount] = constant;
+	return chunk->frameConstantCount++;
+}
+#endif
+
+// Drops every byte from count onwards along with the line runs that only
+// covered them.
+void truncateChunk(Chunk * chunk, int count)
+{
+	chunk->count = count;
+
+#ifdef LOX_JIT
+	// The native code was made from the bytes being dropped.
+	freeNative(chunk);
+	chunk->runs = 0;
+#endif
+
+	while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count)
+		chunk->lineCount--;
+}
+
+int getLine(Chunk * chunk, int offset)
+{
+	// Binary search for the last run starting at or before offset.
+	int low = 0;
+	int high = chunk->lineCount - 1;
+
+	while (low < high)
+	{
+		int mid = low + (high - low + 1) / 2;
+		if (chunk->lines[mid].offset <= offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
+}
+
+// Numbers are matched by their bits so 0 and -0 stay distinct, strings are
+// interned so matching the pointer is enough.
+static bool sameConstant(Value a, Value b)
+{
+	if (IS_NUMBER(a) && IS_NUMBER(b))
+	{
+		double x = AS_NUMBER(a), y = AS_NUMBER(b);
+		return memcmp(&x, &y, sizeof(double)) == 0;
+	}
+
+	return IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b);
+}
+
+static uint32_t hashConstant(Value value)
+{
+	if (IS_OBJ(value))
+		return AS_STRING(value)->hash;
+
+	double number = AS_NUMBER(value);
+	uint64_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdu;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+static void indexConstant(Chunk * chunk, int constant)
+{
+	uint32_t mask = (uint32_t)chunk->indexCapacity - 1;
+	uint32_t slot = hashConstant(chunk->constants.values[constant]) & mask;
+
+	while (chunk->constantIndex[slot] != -1)
+		slot = (slot + 1) & mask;
+
+	chunk->indexUsed++;
+	chunk->constantIndex[slot] = constant;
+}
+
+// Removes constant from the index. The entries after it in the same run are
+// shifted back into the gap when that keeps them reachable from their home
+// slot, so lookups never stop short of them.
+static void unindexConstant(Chunk * chunk, int constant)
+{
+	uint32_t mask = (uint32_t)chunk->indexCapacity - 1;
+	uint32_t hole = hashConstant(chunk->constants.values[constant]) & mask;
+
+	while (chunk->constantIndex[hole] != constant)
+		hole = (hole + 1) & mask;
+
+	for (uint32_t slot = (hole + 1) & mask; chunk->constantIndex[slot] != -1; slot = (slot + 1) & mask)
+	{
+		int entry = chunk->constantIndex[slot];
+		uint32_t home = hashConstant(chunk->constants.values[entry]) & mask;
+
+		if (((slot - home) & mask) >= ((slot - hole) & mask))
+		{
+			chunk->constantIndex[hole] = entry;
+			hole = slot;
+		}
+	}
+
+	chunk->constantIndex[hole] = -1;
+	chunk->indexUsed--;
+}
+
+// Rebuilds the index from the constants, growing it when the pool itself needs
+// more room.
+static void rebuildConstantIndex(Chunk * chunk)
+{
+	int capacity = chunk->indexCapacity;
+	while ((chunk->constants.count + 1) * 2 > capacity)
+		capacity = GROW_CAPACITY(capacity);
+
+	if (capacity != chunk->indexCapacity)
+	{
+		ARENA_FREE_ARRAY(chunk->arena, int, chunk->constantIndex, chunk->indexCapacity, MEM_CONSTANTS);
+		chunk->constantIndex = ARENA_GROW_ARRAY(chunk->arena, NULL, int, 0, capacity, MEM_CONSTANTS);
+		chunk->indexCapacity = capacity;
+	}
+
+	for (int i = 0; i < capacity; i++)
+		chunk->constantIndex[i] = -1;
+	chunk->indexUsed = 0;
+
+	for (int i = 0; i < chunk->constants.count; i++)
+	{
+		Value value = chunk->constants.values[i];
+		if (IS_NUMBER(value) || IS_STRING(value))
+			indexConstant(chunk, i);
+	}
 }
 
 int addConstant(Chunk * chunk, Value value)
 {
+	bool indexable = IS_NUMBER(value) || IS_STRING(value);
+
+	if (indexable && chunk->indexCapacity > 0)
+	{
+		uint32_t mask = (uint32_t)chunk->indexCapacity - 1;
+		uint32_t slot = hashConstant(value) & mask;
+
+		for (int constant = chunk->constantIndex[slot]; constant != -1; constant = chunk->constantIndex[slot])
+		{
+			if (sameConstant(chunk->constants.values[constant], value))
+				return constant;
+
+			slot = (slot + 1) & mask;
+		}
+	}
+
+	// Keep the value reachable in case growing the array triggers a collection.
+	push(value);
 	writeValueArray(&chunk->constants, value);
-	return chunk->constants.count - 1;
+	pop();
+
+	int constant = chunk->constants.count - 1;
+
+	if (indexable)
+	{
+		if ((chunk->indexUsed + 1) * 4 > chunk->indexCapacity * 3)
+			rebuildConstantIndex(chunk);
+		else
+			indexConstant(chunk, constant);
+	}
+
+	return constant;
+}
+
+void truncateConstants(Chunk * chunk, int count)
+{
+	for (int i = chunk->constants.count - 1; i >= count; i--)
+	{
+		Value value = chunk->constants.values[i];
+		if (chunk->indexCapacity > 0 && (IS_NUMBER(value) || IS_STRING(value)))
+			unindexConstant(chunk, i);
+	}
+
+	chunk->constants.count = count;
 }
@@ -6,39 +6,157 @@
 #include "memory.h"
 #include "value.h"
 
+// The opcode list is kept as an X-macro so the enum, the VM dispatch table
+// and anything else indexed by opcode are always generated in the same order.
+// The second column is the length of each instruction in bytes, operands
+// included, and the third the net number of values it pushes.
+#define OPCODE_LIST(X) \
+	X(OP_CONSTANT, 2, 1) \
+	X(OP_CONSTANT_LONG, 4, 1) \
+	X(OP_NIL, 1, 1) \
+	X(OP_TRUE, 1, 1) \
+	X(OP_FALSE, 1, 1) \
+	X(OP_EQUAL, 1, -1) \
+	X(OP_NOT_EQUAL, 1, -1) \
+	X(OP_GREATER, 1, -1) \
+	X(OP_GREATER_EQUAL, 1, -1) \
+	X(OP_LESS, 1, -1) \
+	X(OP_LESS_EQUAL, 1, -1) \
+	X(OP_ADD, 1, -1) \
+	X(OP_ADD_NUM, 1, -1) \
+	X(OP_ADD_STR, 1, -1) \
+	X(OP_SUBTRACT, 1, -1) \
+	X(OP_MULTIPLY, 1, -1) \
+	X(OP_DIVIDE, 1, -1) \
+	X(OP_NOT, 1, 0) \
+	X(OP_NEGATE, 1, 0) \
+	X(OP_RETURN, 1, -1)
+
+// OP_CONSTANT_LONG carries a 24-bit big endian index into the constant pool.
+#define MAX_CONSTANTS (1 << 24)
+
 typedef enum {
-	OP_CONSTANT,
-	OP_CONSTANT_LONG,
-	OP_NIL,
-	OP_TRUE,
-	OP_FALSE,
-	OP_EQUAL,
-	OP_GREATER,
-	OP_LESS,
-	OP_ADD,
-	OP_SUBTRACT,
-	OP_MULTIPLY,
-	OP_DIVIDE,
-	OP_NOT,
-	OP_NEGATE,
-	OP_RETURN,
+#define OPCODE_ENUM(name, length, stackEffect) name,
+	OPCODE_LIST(OPCODE_ENUM)
+#undef OPCODE_ENUM
+	OP_COUNT,
 } OpCode;
 
+#ifdef LOX_REGISTER_VM
+// Three-address instructions of the register backend. Every operand is a slot
+// of the frame the chunk runs in, see allocateRegisters().
+#define REGISTER_OPCODE_LIST(X) \
+	X(REG_EQUAL) \
+	X(REG_NOT_EQUAL) \
+	X(REG_GREATER) \
+	X(REG_GREATER_EQUAL) \
+	X(REG_LESS) \
+	X(REG_LESS_EQUAL) \
+	X(REG_ADD) \
+	X(REG_SUBTRACT) \
+	X(REG_MULTIPLY) \
+	X(REG_DIVIDE) \
+	X(REG_NOT) \
+	X(REG_NEGATE) \
+	X(REG_RETURN)
+
+typedef enum {
+#define REGISTER_OPCODE_ENUM(name) name,
+	REGISTER_OPCODE_LIST(REGISTER_OPCODE_ENUM)
+#undef REGISTER_OPCODE_ENUM
+	REG_COUNT,
+} RegisterOpCode;
+
+// Computes frame[dst] from frame[a] and, for binary operators, frame[b]. The
+// stack instruction it was made from is kept in offset for line numbers.
+typedef struct {
+	uint8_t op;
+	int dst;
+	int a;
+	int b;
+	int offset;
+} RegisterInstruction;
+
+// Frame slots of a chunk. The constants its code loads come first, then nil,
+// true and false, then the registers.
+#define FRAME_NIL(chunk)		((chunk)->frameConstantCount)
+#define FRAME_TRUE(chunk)		((chunk)->frameConstantCount + 1)
+#define FRAME_FALSE(chunk)		((chunk)->frameConstantCount + 2)
+#define FRAME_REGISTERS(chunk)	((chunk)->frameConstantCount + 3)
+#endif
+
+
+#ifdef LOX_JIT
+// Runs a chunk from its first instruction with sp as the top of the stack. It
+// stops at the first instruction left to the interpreter, returning the new
+// top of the stack and setting resume to its offset, or returns NULL after a
+// runtime error.
+typedef Value * (*NativeCode)(Value * sp, int * resume);
+#endif
+
+// Line information is run-length encoded: each entry marks the first byte of
+// code emitted for a new source line.
+typedef struct {
+	int offset;
+	int line;
+} LineStart;
 
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t * code;
-	int * lines;
+	int lineCount;
+	int lineCapacity;
+	LineStart * lines;
 	ValueArray constants;
+	// Open addressed index over constants used to reuse identical values.
+	// Slots hold a constant index or -1 when empty.
+	int indexCapacity;
+	int indexUsed;
+	int * constantIndex;
+	// Deepest the operand stack gets while running this chunk.
+	int maxStack;
+	// Set for chunks shared between VMs, which must not be quickened.
+	bool readOnly;
+#ifdef LOX_REGISTER_VM
+	// The code rewritten for the register backend, and the number of frame
+	// slots it uses with maxStack registers.
+	int registerCodeCount;
+	int registerCodeCapacity;
+	RegisterInstruction * registerCode;
+	int frameSize;
+	// The index in the pool of the constant in each of the first frame slots,
+	// so a run only copies the constants its code loads.
+	int frameConstantCount;
+	int frameConstantCapacity;
+	int * frameConstants;
+#endif
+#ifdef LOX_JIT
+	// Times the chunk was run and its native code once it got hot, see jit.h.
+	int runs;
+	NativeCode native;
+	size_t nativeSize;
+#endif
+	Arena * arena;
 } Chunk;
 
 
 void initChunk(Chunk * chunk);
+void initChunkInArena(Chunk * chunk, Arena * arena);
 void freeChunk(Chunk * chunk);
 
 void writeChunk(Chunk * chunk, uint8_t byte, int line);
+void truncateChunk(Chunk * chunk, int count);
+int getLine(Chunk * chunk, int offset);
 
 int addConstant(Chunk * chunk, Value value);
+// Drops every constant from count onwards.
+void truncateConstants(Chunk * chunk, int count);
+
+#ifdef LOX_REGISTER_VM
+void writeRegisterCode(Chunk * chunk, RegisterInstruction instruction);
+// Gives constant the next frame slot and returns the slot.
+int writeFrameConstant(Chunk * chunk, int constant);
+#endif
 
 #endif
@@ -6,7 +6,63 @@
 #include <stddef.h>
 
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// Threaded dispatch using labels-as-values. Only GCC and Clang support it, every
+// other compiler (or -DLOX_NO_COMPUTED_GOTO) falls back to the switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LOX_NO_COMPUTED_GOTO)
+#define LOX_COMPUTED_GOTO
+#endif
+
+// The scanner uses SSE2 or NEON to skip over runs of characters when the
+// compiler supports it. Compile with -DLOX_NO_SIMD to force the scalar code.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LOX_NO_SIMD)
+#if defined(__SSE2__)
+#define LOX_SIMD_SSE2
+#elif defined(__ARM_NEON)
+#define LOX_SIMD_NEON
+#endif
+#endif
+
+// Compile with -DLOX_GC_GENERATIONAL to allocate new objects in a nursery that
+// is collected on its own, promoting survivors to the old generation.
+
+// Compile with -DLOX_LAZY_INTERN to leave strings made at runtime unhashed and
+// out of the intern table until something needs them there, comparing them by
+// their characters instead.
+
+// Compile with -DLOX_REGISTER_VM to run chunks on the register backend, which
+// executes three-address code rewritten from the stack code by the compiler.
+
+// Compile with -DLOX_JIT (the "jit" configuration of build.bat) to translate
+// hot chunks to native code on x86-64. It builds on the stack backend.
+#if defined(LOX_JIT) && defined(LOX_REGISTER_VM)
+#error "LOX_JIT and LOX_REGISTER_VM can not be combined"
+#endif
+
+// Compile with -DLOX_NAN_BOXING to pack every Value into a single 64-bit word
+// instead of the 16 byte tagged union.
+
+// Storage for per-thread state, like the VM each thread is running.
+#if defined(_MSC_VER)
+#define LOX_THREAD_LOCAL __declspec(thread)
+#else
+#define LOX_THREAD_LOCAL __thread
+#endif
+
+// Compile with -DLOX_BENCH (the "bench" configuration of build.bat) to count
+// executed instructions and enable the --bench flag.
+
+// Compile with -DLOX_PROFILE (the "profile" configuration of build.bat) to
+// profile every instruction run() executes and print a report from freeVM().
+// The register backend and native code are not profiled.
+
+// Tracing (see trace.h) is compiled into everything but release builds, and
+// each kind of trace is switched on at runtime from the command line.
+#if !defined(LOX_RELEASE_BUILD) && !defined(LOX_NO_TRACE)
+#define LOX_TRACE
+#endif
+
+// Collect on every allocation that grows the heap, and log each collection.
+//#define DEBUG_STRESS_GC
+//#define DEBUG_LOG_GC
 
 #endif
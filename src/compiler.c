@@ -1,15 +1,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
+#include "memory.h"
 #include "object.h"
 #include "compiler.h"
 #include "scanner.h"
 
-#ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#endif
+#include "trace.h"
 
 typedef enum {
     PREC_NONE,
@@ -42,13 +43,38 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+typedef struct {
+    int offset;
+    int line;
+    Value value;
+} PendingLiteral;
+
 struct Compiler_ {
     Scanner scanner;
     Parser parser;
     Chunk * compilingChunk;
+
+    // Where the left operand of the infix rule being dispatched starts, both in
+    // the code array and in the constant pool. Used by the constant folder.
+    int operandStart;
+    int operandConstants;
+
+    // Values on the operand stack at the current point of the code.
+    int stackDepth;
+
+    // Literal loads that have no constant yet, in code order. Folding replaces
+    // most of them, so literals only enter the constant pool once the code is
+    // complete, see writeLiterals().
+    PendingLiteral * pending;
+    int pendingCount;
+    int pendingCapacity;
 };
 
 
+// The compiler running on this thread, if any. The collector needs it to find
+// the constants of the chunk being compiled.
+static LOX_THREAD_LOCAL Compiler * current = NULL;
+
 static Chunk * currentChunk(Compiler * compiler)
 {
     return compiler->compilingChunk;
@@ -92,11 +118,11 @@ static void errorAtCurrent(Compiler * compiler, const char * message)
 
 static void advance(Compiler * compiler)
 {
-    printf("Advance\n");
+    TRACE(TRACE_FLAG_PARSE, "Advance\n");
 
     compiler->parser.previous = compiler->parser.current;
 
-    printf("  Previous: %d (%.*s)\n", compiler->parser.previous.type, compiler->parser.previous.length, compiler->parser.previous.start);
+    TRACE(TRACE_FLAG_PARSE, "  Previous: %d (%.*s)\n", compiler->parser.previous.type, compiler->parser.previous.length, compiler->parser.previous.start);
 
     for (;;)
     {
@@ -107,12 +133,12 @@ static void advance(Compiler * compiler)
         errorAtCurrent(compiler, compiler->parser.current.start);
     }
     
-    printf("  Current:  %d (%.*s)\n", compiler->parser.current.type, compiler->parser.current.length, compiler->parser.current.start);   
+    TRACE(TRACE_FLAG_PARSE, "  Current:  %d (%.*s)\n", compiler->parser.current.type, compiler->parser.current.length, compiler->parser.current.start);
 }
 
 static void consume(Compiler * compiler, TokenType type, const char * message)
 {
-    printf("Consuming token %d (%s)\n", type, message);
+    TRACE(TRACE_FLAG_PARSE, "Consuming token %d (%s)\n", type, message);
 
     if (compiler->parser.current.type == type)
     {
@@ -123,6 +149,19 @@ static void consume(Compiler * compiler, TokenType type, const char * message)
     errorAtCurrent(compiler, message);
 }
 
+static const int stackEffects[OP_COUNT] = {
+#define OPCODE_EFFECT(name, length, stackEffect) stackEffect,
+    OPCODE_LIST(OPCODE_EFFECT)
+#undef OPCODE_EFFECT
+};
+
+static void adjustStack(Compiler * compiler, int effect)
+{
+    compiler->stackDepth += effect;
+    if (compiler->stackDepth > currentChunk(compiler)->maxStack)
+        currentChunk(compiler)->maxStack = compiler->stackDepth;
+}
+
 static void emitByte(Compiler * compiler, uint8_t byte)
 {
     writeChunk(currentChunk(compiler), byte, compiler->parser.previous.line);
@@ -134,15 +173,10 @@ static void emitBytes(Compiler * compiler, uint8_t byte1, uint8_t byte2)
     emitByte(compiler, byte2);
 }
 
-static void emitReturn(Compiler * compiler)
-{
-    emitByte(compiler, OP_RETURN);
-}
-
 static int makeConstant(Compiler * compiler, Value value)
 {
     int constant = addConstant(currentChunk(compiler), value);
-    if (constant > UINT8_MAX)
+    if (constant >= MAX_CONSTANTS)
     {
         error(compiler, "Too many constants in one chunk.");
         return 0;
@@ -151,30 +185,326 @@ static int makeConstant(Compiler * compiler, Value value)
     return constant;
 }
 
-static void emitConstant(Compiler * compiler, Value value)
+// Writes the load of a literal without touching the stack depth.
+static void writeLiteral(Compiler * compiler, Value value, int line)
 {
-    int constant = makeConstant(compiler, value);
+    Chunk * chunk = currentChunk(compiler);
 
-    if (constant < 256)
+    if (IS_NIL(value))
+    {
+        writeChunk(chunk, OP_NIL, line);
+    }
+    else if (IS_BOOL(value))
     {
-        emitBytes(compiler, OP_CONSTANT, (uint8_t)constant);
+        writeChunk(chunk, AS_BOOL(value) ? OP_TRUE : OP_FALSE, line);
     }
     else
     {
-        emitByte(compiler, OP_CONSTANT_LONG);
-        emitBytes(compiler, (uint8_t)((constant & 0x0000ff00) >> 8), (uint8_t)(constant & 0x000000ff));
+        int constant = makeConstant(compiler, value);
+
+        if (constant < 256)
+        {
+            writeChunk(chunk, OP_CONSTANT, line);
+            writeChunk(chunk, (uint8_t)constant, line);
+        }
+        else
+        {
+            writeChunk(chunk, OP_CONSTANT_LONG, line);
+            writeChunk(chunk, (uint8_t)((constant & 0x00ff0000) >> 16), line);
+            writeChunk(chunk, (uint8_t)((constant & 0x0000ff00) >> 8), line);
+            writeChunk(chunk, (uint8_t)(constant & 0x000000ff), line);
+        }
+    }
+}
+
+// Writes the code again with real loads in place of the pending literals.
+// Their placeholders are a single byte, so the code can grow or shrink, which
+// is why this waits until nothing refers to offsets in it any more.
+static void writeLiterals(Compiler * compiler)
+{
+    if (compiler->pendingCount == 0)
+        return;
+
+    Chunk * chunk = currentChunk(compiler);
+    int count = chunk->count;
+    int lineCount = chunk->lineCount;
+    uint8_t * code = (uint8_t *)malloc(count);
+    LineStart * lines = (LineStart *)malloc(sizeof(LineStart) * lineCount);
+    memcpy(code, chunk->code, count);
+    memcpy(lines, chunk->lines, sizeof(LineStart) * lineCount);
+
+    truncateChunk(chunk, 0);
+
+    int pending = 0;
+    int run = 0;
+    for (int offset = 0; offset < count; offset++)
+    {
+        while (run + 1 < lineCount && lines[run + 1].offset <= offset)
+            run++;
+
+        if (pending < compiler->pendingCount && compiler->pending[pending].offset == offset)
+            writeLiteral(compiler, compiler->pending[pending++].value, lines[run].line);
+        else
+            writeChunk(chunk, code[offset], lines[run].line);
+    }
+
+    compiler->pendingCount = 0;
+    free(code);
+    free(lines);
+}
+
+static void emitOp(Compiler * compiler, OpCode op)
+{
+    emitByte(compiler, (uint8_t)op);
+    adjustStack(compiler, stackEffects[op]);
+}
+
+static void emitReturn(Compiler * compiler)
+{
+    emitOp(compiler, OP_RETURN);
+}
+
+// Loads a literal. While folding, the load is a one byte placeholder until the
+// code is complete, readLiteral() sees through it.
+static void emitLiteral(Compiler * compiler, Value value)
+{
+    Chunk * chunk = currentChunk(compiler);
+    int line = compiler->parser.previous.line;
+
+    if (!vm->foldConstants)
+    {
+        writeLiteral(compiler, value, line);
+        adjustStack(compiler, 1);
+        return;
+    }
+
+    if (compiler->pendingCapacity < compiler->pendingCount + 1)
+    {
+        // Growing can collect, and value is not rooted anywhere yet.
+        int oldCapacity = compiler->pendingCapacity;
+        compiler->pendingCapacity = GROW_CAPACITY(oldCapacity);
+        push(value);
+        compiler->pending = GROW_ARRAY(compiler->pending, PendingLiteral, oldCapacity, compiler->pendingCapacity, MEM_CONSTANTS);
+        pop();
+    }
+
+    PendingLiteral * literal = &compiler->pending[compiler->pendingCount++];
+    literal->offset = chunk->count;
+    literal->line = line;
+    literal->value = value;
+
+    writeChunk(chunk, OP_NIL, line);
+    adjustStack(compiler, 1);
+}
+
+// Checks if the code between start and end is exactly one instruction that
+// loads a literal, and returns the literal in value.
+static bool readLiteral(Compiler * compiler, int start, int end, Value * value)
+{
+    Chunk * chunk = currentChunk(compiler);
+    int length = end - start;
+
+    if (length <= 0)
+        return false;
+
+    for (int i = compiler->pendingCount - 1; i >= 0 && compiler->pending[i].offset >= start; i--)
+    {
+        if (compiler->pending[i].offset == start)
+        {
+            *value = compiler->pending[i].value;
+            return length == 1;
+        }
+    }
+
+    switch (chunk->code[start])
+    {
+        case OP_CONSTANT:
+            if (length != 2)
+                return false;
+            *value = chunk->constants.values[chunk->code[start + 1]];
+            return true;
+
+        case OP_CONSTANT_LONG:
+            if (length != 4)
+                return false;
+            *value = chunk->constants.values[(chunk->code[start + 1] << 16) | (chunk->code[start + 2] << 8) | chunk->code[start + 3]];
+            return true;
+
+        case OP_NIL:    *value = NIL_VAL; return length == 1;
+        case OP_TRUE:   *value = BOOL_VAL(true); return length == 1;
+        case OP_FALSE:  *value = BOOL_VAL(false); return length == 1;
+
+        default:
+            return false;
+    }
+}
+
+// Drops everything emitted since start. Constants added after constantCount
+// can only be referenced by the dropped code so they are removed as well.
+// values is how many values the dropped code left on the stack.
+static void rewindChunk(Compiler * compiler, int start, int constantCount, int values)
+{
+    Chunk * chunk = currentChunk(compiler);
+    compiler->stackDepth -= values;
+    truncateChunk(chunk, start);
+    truncateConstants(chunk, constantCount);
+
+    while (compiler->pendingCount > 0 && compiler->pending[compiler->pendingCount - 1].offset >= start)
+        compiler->pendingCount--;
+}
+
+static bool isFalseyLiteral(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Evaluates a binary operator over two literals at compile time. Returns false
+// when the operation has to be left to the VM, including every case that would
+// produce a runtime error.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value * result)
+{
+    switch (operatorType)
+    {
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+        default:
+            break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch (operatorType)
+    {
+        case TOKEN_GREATER:         *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL:   *result = BOOL_VAL(x >= y); return true;
+        case TOKEN_LESS:            *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL:      *result = BOOL_VAL(x <= y); return true;
+        case TOKEN_PLUS:            *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:           *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:            *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:           *result = NUMBER_VAL(x / y); return true;
+        default:
+            return false;
+    }
+}
+
+#ifdef LOX_REGISTER_VM
+static RegisterOpCode registerOp(OpCode op)
+{
+    switch (op)
+    {
+        case OP_EQUAL:          return REG_EQUAL;
+        case OP_NOT_EQUAL:      return REG_NOT_EQUAL;
+        case OP_GREATER:        return REG_GREATER;
+        case OP_GREATER_EQUAL:  return REG_GREATER_EQUAL;
+        case OP_LESS:           return REG_LESS;
+        case OP_LESS_EQUAL:     return REG_LESS_EQUAL;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:        return REG_ADD;
+        case OP_SUBTRACT:       return REG_SUBTRACT;
+        case OP_MULTIPLY:       return REG_MULTIPLY;
+        case OP_DIVIDE:         return REG_DIVIDE;
+        case OP_NOT:            return REG_NOT;
+        case OP_NEGATE:         return REG_NEGATE;
+        default:                return REG_RETURN;
     }
 }
 
+// Rewrites the stack code of a chunk for the register backend. The value at
+// depth n of the operand stack lives in register n, and literals are read
+// straight from their frame slots, so none of the loads survive and every
+// operator names where its operands come from and where its result goes.
+// Every constant load gets a frame slot of its own, which keeps the frame
+// proportional to the code rather than to the constant pool.
+void allocateRegisters(Chunk * chunk)
+{
+    int loads = 0;
+    for (int offset = 0; offset < chunk->count;)
+    {
+        uint8_t op = chunk->code[offset];
+        if (op == OP_CONSTANT || op == OP_CONSTANT_LONG)
+            loads++;
+        offset += op == OP_CONSTANT ? 2 : op == OP_CONSTANT_LONG ? 4 : 1;
+    }
+
+    chunk->frameConstantCount = 0;
+    int registers = loads + 3;
+    chunk->frameSize = registers + chunk->maxStack;
+    chunk->registerCodeCount = 0;
+
+    // The frame slot holding each value on the simulated operand stack.
+    int * slots = (int *)malloc(sizeof(int) * (chunk->maxStack + 1));
+    int depth = 0;
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        uint8_t op = chunk->code[offset];
+        RegisterInstruction instruction = { 0, 0, 0, 0, offset };
+
+        switch (op)
+        {
+            case OP_CONSTANT:
+                slots[depth++] = writeFrameConstant(chunk, chunk->code[offset + 1]);
+                offset += 2;
+                continue;
+
+            case OP_CONSTANT_LONG:
+                slots[depth++] = writeFrameConstant(chunk, (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+                offset += 4;
+                continue;
+
+            case OP_NIL:    slots[depth++] = loads; offset++; continue;
+            case OP_TRUE:   slots[depth++] = loads + 1; offset++; continue;
+            case OP_FALSE:  slots[depth++] = loads + 2; offset++; continue;
+
+            case OP_NOT:
+            case OP_NEGATE:
+                instruction.op = (uint8_t)registerOp((OpCode)op);
+                instruction.a = slots[depth - 1];
+                instruction.dst = registers + depth - 1;
+                slots[depth - 1] = instruction.dst;
+                break;
+
+            case OP_RETURN:
+                instruction.op = REG_RETURN;
+                instruction.a = slots[--depth];
+                break;
+
+            default:
+                instruction.op = (uint8_t)registerOp((OpCode)op);
+                instruction.b = slots[--depth];
+                instruction.a = slots[depth - 1];
+                instruction.dst = registers + depth - 1;
+                slots[depth - 1] = instruction.dst;
+                break;
+        }
+
+        writeRegisterCode(chunk, instruction);
+        offset++;
+    }
+
+    free(slots);
+}
+#endif
+
 static void endCompiler(Compiler * compiler)
 {
     emitReturn(compiler);
+    writeLiterals(compiler);
 
-#ifdef DEBUG_PRINT_CODE
+#ifdef LOX_REGISTER_VM
     if (!compiler->parser.hasError)
-    {
-        dissassembleChunk(currentChunk(compiler), "code");
-    }
+        allocateRegisters(currentChunk(compiler));
+#endif
+
+#ifdef LOX_TRACE
+    if (TRACING(TRACE_FLAG_BYTECODE) && !compiler->parser.hasError)
+        dumpChunk(currentChunk(compiler));
 #endif
 }
 
@@ -183,27 +513,126 @@ static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Compiler * compiler, Precedence precedence);
 
 
+typedef struct {
+    char * chars;
+    int length;
+    int capacity;
+} CharBuffer;
+
+static void appendChars(CharBuffer * buffer, ObjString * string)
+{
+    if (buffer->capacity < buffer->length + string->length)
+    {
+        while (buffer->capacity < buffer->length + string->length)
+            buffer->capacity = GROW_CAPACITY(buffer->capacity);
+        buffer->chars = (char *)realloc(buffer->chars, buffer->capacity);
+    }
+
+    memcpy(buffer->chars + buffer->length, string->chars, string->length);
+    buffer->length += string->length;
+}
+
+// Folds a run of string literals joined by +, starting with the two at start.
+// Their characters are gathered in one buffer and interned once the run ends,
+// rather than interning every prefix of it on the way. Until then the chunk
+// loads the result with a long constant whose index is filled in last.
+static void foldConcatenation(Compiler * compiler, ObjString * a, ObjString * b, int start, int constantCount)
+{
+    Chunk * chunk = currentChunk(compiler);
+    CharBuffer run = { NULL, 0, 0 };
+    appendChars(&run, a);
+    appendChars(&run, b);
+    rewindChunk(compiler, start, constantCount, 2);
+
+    int loadStart = chunk->count;
+    int loadConstants = chunk->constants.count;
+
+    while (compiler->parser.current.type == TOKEN_PLUS)
+    {
+        if (chunk->count == loadStart)
+        {
+            emitOp(compiler, OP_CONSTANT_LONG);
+            emitByte(compiler, 0);
+            emitBytes(compiler, 0, 0);
+        }
+
+        advance(compiler);
+        TRACE(TRACE_FLAG_PARSE, "Binary\n");
+
+        int rightStart = chunk->count;
+        int rightConstants = chunk->constants.count;
+        parsePrecedence(compiler, (Precedence)(PREC_TERM + 1));
+
+        Value right;
+        if (!readLiteral(compiler, rightStart, chunk->count, &right) || !IS_STRING(right))
+        {
+            // The run ends at an operand known only at runtime, which already
+            // follows the load.
+            int constant = makeConstant(compiler, OBJ_VAL(copyString(run.chars, run.length)));
+            chunk->code[loadStart + 1] = (uint8_t)((constant & 0x00ff0000) >> 16);
+            chunk->code[loadStart + 2] = (uint8_t)((constant & 0x0000ff00) >> 8);
+            chunk->code[loadStart + 3] = (uint8_t)(constant & 0x000000ff);
+
+            emitOp(compiler, OP_ADD);
+            free(run.chars);
+            return;
+        }
+
+        appendChars(&run, AS_STRING(right));
+        rewindChunk(compiler, rightStart, rightConstants, 1);
+    }
+
+    if (chunk->count != loadStart)
+        rewindChunk(compiler, loadStart, loadConstants, 1);
+
+    emitLiteral(compiler, OBJ_VAL(copyString(run.chars, run.length)));
+    free(run.chars);
+}
+
 static void binary(Compiler * compiler)
 {
-    printf("Binary\n");
+    TRACE(TRACE_FLAG_PARSE, "Binary\n");
 
     TokenType operatorType = compiler->parser.previous.type;
+    int leftStart = compiler->operandStart;
+    int leftConstants = compiler->operandConstants;
 
     ParseRule * rule = getRule(operatorType);
+    int rightStart = currentChunk(compiler)->count;
     parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
 
+    // Both operands are literals, replace them with the result.
+    Value a, b, result;
+    if (vm->foldConstants &&
+        readLiteral(compiler, leftStart, rightStart, &a) &&
+        readLiteral(compiler, rightStart, currentChunk(compiler)->count, &b))
+    {
+        if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b))
+        {
+            foldConcatenation(compiler, AS_STRING(a), AS_STRING(b), leftStart, leftConstants);
+            return;
+        }
+
+        if (foldBinary(operatorType, a, b, &result))
+        {
+            rewindChunk(compiler, leftStart, leftConstants, 2);
+            emitLiteral(compiler, result);
+            return;
+        }
+    }
+
     switch (operatorType)
     {
-        case TOKEN_BANG_EQUAL:      emitBytes(compiler, OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:     emitByte(compiler, OP_EQUAL); break;
-        case TOKEN_GREATER:         emitByte(compiler, OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL:   emitBytes(compiler, OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:            emitByte(compiler, OP_LESS); break;
-        case TOKEN_LESS_EQUAL:      emitBytes(compiler, OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:            emitByte(compiler, OP_ADD); break;
-        case TOKEN_MINUS:           emitByte(compiler, OP_SUBTRACT); break;
-        case TOKEN_STAR:            emitByte(compiler, OP_MULTIPLY); break;
-        case TOKEN_SLASH:           emitByte(compiler, OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:      emitOp(compiler, OP_NOT_EQUAL); break;
+        case TOKEN_EQUAL_EQUAL:     emitOp(compiler, OP_EQUAL); break;
+        case TOKEN_GREATER:         emitOp(compiler, OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL:   emitOp(compiler, OP_GREATER_EQUAL); break;
+        case TOKEN_LESS:            emitOp(compiler, OP_LESS); break;
+        case TOKEN_LESS_EQUAL:      emitOp(compiler, OP_LESS_EQUAL); break;
+        case TOKEN_PLUS:            emitOp(compiler, OP_ADD); break;
+        case TOKEN_MINUS:           emitOp(compiler, OP_SUBTRACT); break;
+        case TOKEN_STAR:            emitOp(compiler, OP_MULTIPLY); break;
+        case TOKEN_SLASH:           emitOp(compiler, OP_DIVIDE); break;
         default:
             return; // Unreachable.
     }
@@ -211,12 +640,12 @@ static void binary(Compiler * compiler)
 
 static void literal(Compiler * compiler)
 {
-    printf("Literal\n");
+    TRACE(TRACE_FLAG_PARSE, "Literal\n");
     switch (compiler->parser.previous.type)
     {
-        case TOKEN_FALSE:   emitByte(compiler, OP_FALSE); break;
-        case TOKEN_NIL:     emitByte(compiler, OP_NIL); break;
-        case TOKEN_TRUE:    emitByte(compiler, OP_TRUE); break;
+        case TOKEN_FALSE:   emitLiteral(compiler, BOOL_VAL(false)); break;
+        case TOKEN_NIL:     emitLiteral(compiler, NIL_VAL); break;
+        case TOKEN_TRUE:    emitLiteral(compiler, BOOL_VAL(true)); break;
         default:
             return; // Unreachable.
     }
@@ -224,38 +653,58 @@ static void literal(Compiler * compiler)
 
 static void grouping(Compiler * compiler)
 {
-    printf("Grouping\n");
+    TRACE(TRACE_FLAG_PARSE, "Grouping\n");
     expression(compiler);
     consume(compiler, TOKEN_RIGHT_PAREN, "Expected ')' after expression.");
 }
 
 static void number(Compiler * compiler)
 {
-    printf("Number\n");
+    TRACE(TRACE_FLAG_PARSE, "Number\n");
     double value = strtod(compiler->parser.previous.start, NULL);
-    emitConstant(compiler, NUMBER_VAL(value));
+    emitLiteral(compiler, NUMBER_VAL(value));
 }
 
 static void string(Compiler * compiler)
 {
-    printf("String\n");
-    emitConstant(compiler, OBJ_VAL(copyString(compiler->parser.previous.start + 1,
+    TRACE(TRACE_FLAG_PARSE, "String\n");
+    emitLiteral(compiler, OBJ_VAL(copyString(compiler->parser.previous.start + 1,
                                               compiler->parser.previous.length - 2)));
 }
 
 static void unary(Compiler * compiler)
 {
-    printf("Unary\n");
+    TRACE(TRACE_FLAG_PARSE, "Unary\n");
     TokenType operatorType = compiler->parser.previous.type;
+    int operandStart = currentChunk(compiler)->count;
+    int operandConstants = currentChunk(compiler)->constants.count;
 
     // Compile the operand.
     parsePrecedence(compiler, PREC_UNARY);
 
+    // Fold the operator into a literal operand.
+    Value operand;
+    if (vm->foldConstants && readLiteral(compiler, operandStart, currentChunk(compiler)->count, &operand))
+    {
+        if (operatorType == TOKEN_BANG)
+        {
+            rewindChunk(compiler, operandStart, operandConstants, 1);
+            emitLiteral(compiler, BOOL_VAL(isFalseyLiteral(operand)));
+            return;
+        }
+        else if (operatorType == TOKEN_MINUS && IS_NUMBER(operand))
+        {
+            rewindChunk(compiler, operandStart, operandConstants, 1);
+            emitLiteral(compiler, NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
+
     // Emit the operator instruction.
     switch (operatorType)
     {
-        case TOKEN_BANG: emitByte(compiler, OP_NOT); break;
-        case TOKEN_MINUS: emitByte(compiler, OP_NEGATE); break;
+        case TOKEN_BANG: emitOp(compiler, OP_NOT); break;
+        case TOKEN_MINUS: emitOp(compiler, OP_NEGATE); break;
         default:
             return; // Unreachable.
     }
@@ -306,11 +755,14 @@ ParseRule rules[] = {
 
 static void parsePrecedence(Compiler * compiler, Precedence precedence)
 {
-    printf("ParsePrecedence: %d\n", precedence);
-    printf("  Previous: %d (%.*s)\n", compiler->parser.previous.type, compiler->parser.previous.length, compiler->parser.previous.start);
-    printf("  Current:  %d (%.*s)\n", compiler->parser.current.type, compiler->parser.current.length, compiler->parser.current.start);
+    TRACE(TRACE_FLAG_PARSE, "ParsePrecedence: %d\n", precedence);
+    TRACE(TRACE_FLAG_PARSE, "  Previous: %d (%.*s)\n", compiler->parser.previous.type, compiler->parser.previous.length, compiler->parser.previous.start);
+    TRACE(TRACE_FLAG_PARSE, "  Current:  %d (%.*s)\n", compiler->parser.current.type, compiler->parser.current.length, compiler->parser.current.start);
 
     advance(compiler);
+    int operandStart = currentChunk(compiler)->count;
+    int operandConstants = currentChunk(compiler)->constants.count;
+
     ParseFn prefixRule = getRule(compiler->parser.previous.type)->prefix;
     if (prefixRule == NULL)
     {
@@ -318,14 +770,16 @@ static void parsePrecedence(Compiler * compiler, Precedence precedence)
         return;
     }
 
-    printf("  PrefixRule\n");
+    TRACE(TRACE_FLAG_PARSE, "  PrefixRule\n");
     prefixRule(compiler);
 
     while (precedence <= getRule(compiler->parser.current.type)->precedence)
     {
         advance(compiler);
         ParseFn infixRule = getRule(compiler->parser.previous.type)->infix;
-        printf("  InfixRule\n");
+        TRACE(TRACE_FLAG_PARSE, "  InfixRule\n");
+        compiler->operandStart = operandStart;
+        compiler->operandConstants = operandConstants;
         infixRule(compiler);
     }
 }
@@ -337,7 +791,7 @@ static ParseRule * getRule(TokenType type)
 
 static void expression(Compiler * compiler)
 {
-    printf("Expression\n");
+    TRACE(TRACE_FLAG_PARSE, "Expression\n");
     parsePrecedence(compiler, PREC_ASSIGNMENT);
 }
 
@@ -345,14 +799,33 @@ bool compile(const char * source, Chunk * chunk)
 {
     Compiler compiler;
     initScanner(&compiler.scanner, source);
+    current = &compiler;
 
     compiler.compilingChunk = chunk; 
     compiler.parser.hasError = false;
     compiler.parser.panicMode = false;
+    compiler.stackDepth = 0;
+    compiler.pending = NULL;
+    compiler.pendingCount = 0;
+    compiler.pendingCapacity = 0;
 
     advance(&compiler);
     expression(&compiler);
     consume(&compiler, TOKEN_EOF, "Expected end of expression.");
     endCompiler(&compiler);
+    current = NULL;
+
+    FREE_ARRAY(PendingLiteral, compiler.pending, compiler.pendingCapacity, MEM_CONSTANTS);
+
     return !compiler.parser.hasError;
 }
+
+void markCompilerRoots()
+{
+    if (current == NULL)
+        return;
+
+    markArray(&currentChunk(current)->constants);
+    for (int i = 0; i < current->pendingCount; i++)
+        markValue(current->pending[i].value);
+}
@@ -6,5 +6,11 @@
 
 
 bool compile(const char * source, Chunk * chunk);
+void markCompilerRoots();
+
+#ifdef LOX_REGISTER_VM
+// Builds the register code of a chunk from its stack code, see chunk.h.
+void allocateRegisters(Chunk * chunk);
+#endif
 
 #endif
\ No newline at end of file
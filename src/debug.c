@@ -2,12 +2,13 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "trace.h"
 #include "value.h"
 
 
 static int simpleInstruction(const char * name, int offset)
 {
-	printf("%s\n", name);
+	fprintf(traceOut, "%s\n", name);
 	return offset + 1;
 }
 
@@ -20,15 +21,15 @@ static int constantInstruction(const char * name, Chunk * chunk, int offset, int
 		constant = constant | chunk->code[offset + i + 1];
 	}
 
-	printf("%-16s %4d '", name, constant);
-	printValue(chunk->constants.values[constant]);
-	printf("'\n");
+	fprintf(traceOut, "%-16s %4d '", name, constant);
+	fprintValue(traceOut, chunk->constants.values[constant]);
+	fprintf(traceOut, "'\n");
 	return offset + 1 + constantSize;
 }
 
 void dissassembleChunk(Chunk * chunk, const char * name)
 {
-	printf("== %s ==\n", name);
+	fprintf(traceOut, "== %s ==\n", name);
 
 	for (int offset = 0; offset < chunk->count;)
 	{
@@ -36,14 +37,23 @@ void dissassembleChunk(Chunk * chunk, const char * name)
 	}
 }
 
+void dumpChunk(Chunk * chunk)
+{
+	dissassembleChunk(chunk, "code");
+#ifdef LOX_REGISTER_VM
+	dissassembleRegisterCode(chunk, "registers");
+#endif
+}
+
 int dissassembleInstruction(Chunk * chunk, int offset)
 {
-	printf("%04d ", offset);
+	fprintf(traceOut, "%04d ", offset);
 
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
-		printf("   | ");
+	int line = getLine(chunk, offset);
+	if (offset > 0 && line == getLine(chunk, offset - 1))
+		fprintf(traceOut, "   | ");
 	else
-		printf("%4d ", chunk->lines[offset]);
+		fprintf(traceOut, "%4d ", line);
 
 	uint8_t instruction = chunk->code[offset];
 	switch (instruction)
@@ -51,7 +61,7 @@ int dissassembleInstruction(Chunk * chunk, int offset)
 		case OP_CONSTANT:
 			return constantInstruction("OP_CONSTANT", chunk, offset, 1);
 		case OP_CONSTANT_LONG:
-			return constantInstruction("OP_CONSTANT_LONG", chunk, offset, 2);
+			return constantInstruction("OP_CONSTANT_LONG", chunk, offset, 3);
 		case OP_NIL:
 			return simpleInstruction("OP_NIL", offset);
 		case OP_TRUE:
@@ -60,12 +70,22 @@ int dissassembleInstruction(Chunk * chunk, int offset)
 			return simpleInstruction("OP_FALSE", offset);
 		case OP_EQUAL:
 			return simpleInstruction("OP_EQUAL", offset);
+		case OP_NOT_EQUAL:
+			return simpleInstruction("OP_NOT_EQUAL", offset);
 		case OP_GREATER:
 			return simpleInstruction("OP_GREATER", offset);
+		case OP_GREATER_EQUAL:
+			return simpleInstruction("OP_GREATER_EQUAL", offset);
 		case OP_LESS:
 			return simpleInstruction("OP_LESS", offset);
+		case OP_LESS_EQUAL:
+			return simpleInstruction("OP_LESS_EQUAL", offset);
 		case OP_ADD:
 			return simpleInstruction("OP_ADD", offset);
+		case OP_ADD_NUM:
+			return simpleInstruction("OP_ADD_NUM", offset);
+		case OP_ADD_STR:
+			return simpleInstruction("OP_ADD_STR", offset);
 		case OP_SUBTRACT:
 			return simpleInstruction("OP_SUBTRACT", offset);
 		case OP_MULTIPLY:
@@ -79,7 +99,65 @@ int dissassembleInstruction(Chunk * chunk, int offset)
 		case OP_RETURN:
 			return simpleInstruction("OP_RETURN", offset);
 		default:
-			printf("Unknown opcode %d\n", instruction);
+			fprintf(traceOut, "Unknown opcode %d\n", instruction);
 			return offset + 1;
 	}
 }
+
+#ifdef LOX_REGISTER_VM
+static const char * registerOpNames[REG_COUNT] = {
+#define REGISTER_OPCODE_NAME(name) #name,
+	REGISTER_OPCODE_LIST(REGISTER_OPCODE_NAME)
+#undef REGISTER_OPCODE_NAME
+};
+
+// Frame slots below the registers are printed as the value they hold.
+static void printSlot(Chunk * chunk, int slot)
+{
+	if (slot < chunk->frameConstantCount)
+	{
+		fprintf(traceOut, "'");
+		fprintValue(traceOut, chunk->constants.values[chunk->frameConstants[slot]]);
+		fprintf(traceOut, "'");
+	}
+	else if (slot < FRAME_REGISTERS(chunk))
+	{
+		fprintf(traceOut, "%s", slot == FRAME_NIL(chunk) ? "nil" : slot == FRAME_TRUE(chunk) ? "true" : "false");
+	}
+	else
+	{
+		fprintf(traceOut, "r%d", slot - FRAME_REGISTERS(chunk));
+	}
+}
+
+void dissassembleRegisterCode(Chunk * chunk, const char * name)
+{
+	fprintf(traceOut, "== %s ==\n", name);
+
+	for (int i = 0; i < chunk->registerCodeCount; i++)
+		dissassembleRegisterInstruction(chunk, i);
+}
+
+void dissassembleRegisterInstruction(Chunk * chunk, int index)
+{
+	RegisterInstruction * instruction = &chunk->registerCode[index];
+	fprintf(traceOut, "%04d %4d %-18s ", index, getLine(chunk, instruction->offset), registerOpNames[instruction->op]);
+
+	if (instruction->op != REG_RETURN)
+	{
+		printSlot(chunk, instruction->dst);
+		fprintf(traceOut, " <- ");
+	}
+
+	printSlot(chunk, instruction->a);
+
+	if (instruction->op != REG_RETURN &&
+		instruction->op != REG_NOT && instruction->op != REG_NEGATE)
+	{
+		fprintf(traceOut, ", ");
+		printSlot(chunk, instruction->b);
+	}
+
+	fprintf(traceOut, "\n");
+}
+#endif
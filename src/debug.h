@@ -5,6 +5,13 @@
 #include "chunk.h"
 
 void dissassembleChunk(Chunk * chunk, const char * name);
+// What --dump-bytecode prints for every chunk that is going to run.
+void dumpChunk(Chunk * chunk);
 int dissassembleInstruction(Chunk * chunk, int offset);
 
+#ifdef LOX_REGISTER_VM
+void dissassembleRegisterCode(Chunk * chunk, const char * name);
+void dissassembleRegisterInstruction(Chunk * chunk, int index);
+#endif
+
 #endif
\ No newline at end of file
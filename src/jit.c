@@ -0,0 +1,491 @@
+#if !defined(LOX_PLATFORM_WINDOWS)
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(LOX_PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include "jit.h"
+
+#ifdef LOX_JIT
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LOX_JIT_X64
+#endif
+
+#ifdef LOX_JIT_X64
+
+// Native code keeps the stack in rbx and the resume pointer in r12, both callee
+// saved.
+#define VALUE_SIZE ((int)sizeof(Value))
+
+#ifdef LOX_NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int)offsetof(Value, as))
+#endif
+
+// Moves between rbx, r12 and the registers of the first two integer arguments.
+#if defined(_WIN64)
+#define LEA_ARG0_RBX	0x48, 0x8d, 0x8b	// lea rcx, [rbx + disp32]
+#define MOV_ARG1_IMM	0xba				// mov edx, imm32
+#define MOV_RBX_ARG0	0x48, 0x89, 0xcb	// mov rbx, rcx
+#define MOV_R12_ARG1	0x49, 0x89, 0xd4	// mov r12, rdx
+#else
+#define LEA_ARG0_RBX	0x48, 0x8d, 0xbb	// lea rdi, [rbx + disp32]
+#define MOV_ARG1_IMM	0xbe				// mov esi, imm32
+#define MOV_RBX_ARG0	0x48, 0x89, 0xfb	// mov rbx, rdi
+#define MOV_R12_ARG1	0x49, 0x89, 0xf4	// mov r12, rsi
+#endif
+
+// Stack reserved below the saved registers. It realigns rsp to 16 bytes for
+// calls and covers the 32 bytes a Windows callee may spill its arguments to.
+#define FRAME_SIZE 40
+
+// Jump opcodes, all but JMP follow a 0x0f prefix.
+#define JMP	0xe9
+#define JE	0x84
+#define JNE	0x85
+#define JA	0x87
+#define JAE	0x83
+
+typedef struct {
+	uint8_t * code;
+	int count;
+	int capacity;
+	bool failed;
+
+	// Values on the stack at the instruction being translated, and which of
+	// them are known to be numbers.
+	int depth;
+	bool * numbers;
+} Assembler;
+
+
+static void emit(Assembler * as, uint8_t byte)
+{
+	if (as->capacity < as->count + 1)
+	{
+		int capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+		uint8_t * code = (uint8_t *)realloc(as->code, capacity);
+		if (code == NULL)
+		{
+			as->failed = true;
+			return;
+		}
+
+		as->code = code;
+		as->capacity = capacity;
+	}
+
+	as->code[as->count++] = byte;
+}
+
+#define EMIT(as, ...) \
+	do { \
+		static const uint8_t bytes[] = { __VA_ARGS__ }; \
+		for (size_t i = 0; i < sizeof(bytes); i++) \
+			emit(as, bytes[i]); \
+	} while (false)
+
+static void emit32(Assembler * as, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		emit(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void emit64(Assembler * as, uint64_t value)
+{
+	emit32(as, (uint32_t)value);
+	emit32(as, (uint32_t)(value >> 32));
+}
+
+// Emits a jump with a 32-bit displacement and returns where that displacement
+// is, to be filled in by patchJump().
+static int emitJump(Assembler * as, uint8_t op)
+{
+	if (op != JMP)
+		emit(as, 0x0f);
+	emit(as, op);
+
+	emit32(as, 0);
+	return as->count - 4;
+}
+
+// Points the jump at patch to the current end of the code.
+static void patchJump(Assembler * as, int patch)
+{
+	if (as->failed)
+		return;
+
+	uint32_t displacement = (uint32_t)(as->count - (patch + 4));
+	for (int i = 0; i < 4; i++)
+		as->code[patch + i] = (uint8_t)(displacement >> (i * 8));
+}
+
+static void emitEpilogue(Assembler * as)
+{
+	EMIT(as, 0x48, 0x83, 0xc4, FRAME_SIZE);	// add rsp, FRAME_SIZE
+	EMIT(as, 0x41, 0x5c);					// pop r12
+	EMIT(as, 0x5b);							// pop rbx
+	EMIT(as, 0xc3);							// ret
+}
+
+// Stack slots are addressed from rbx, which holds the top of the stack the
+// native code was entered with. Their depth is known at every instruction.
+#define SLOT(slot) ((uint32_t)((slot) * VALUE_SIZE))
+
+// Returns to runNative() so the interpreter picks up at offset.
+static void emitExit(Assembler * as, int offset)
+{
+	EMIT(as, 0x41, 0xc7, 0x04, 0x24);		// mov dword [r12], offset
+	emit32(as, (uint32_t)offset);
+	EMIT(as, 0x48, 0x8d, 0x83);				// lea rax, [rbx + disp32]
+	emit32(as, SLOT(as->depth));
+	emitEpilogue(as);
+}
+
+// Writes value to a stack slot, 8 bytes at a time.
+static void emitStoreValue(Assembler * as, int slot, Value value)
+{
+	uint64_t words[sizeof(Value) / 8];
+	memset(words, 0, sizeof(words));
+	memcpy(words, &value, sizeof(Value));
+
+	for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+	{
+		EMIT(as, 0x48, 0xb8);				// mov rax, imm64
+		emit64(as, words[i]);
+		EMIT(as, 0x48, 0x89, 0x83);			// mov [rbx + disp32], rax
+		emit32(as, SLOT(slot) + (uint32_t)(i * 8));
+	}
+}
+
+static void emitPush(Assembler * as, Value value)
+{
+	emitStoreValue(as, as->depth, value);
+	as->numbers[as->depth++] = IS_NUMBER(value);
+}
+
+// Jumps when the value in slot is not a number. Returns the jump to patch.
+static int emitNumberGuard(Assembler * as, int slot)
+{
+#ifdef LOX_NAN_BOXING
+	EMIT(as, 0x48, 0x8b, 0x83);				// mov rax, [rbx + disp32]
+	emit32(as, SLOT(slot));
+	EMIT(as, 0x48, 0xb9);					// mov rcx, QNAN
+	emit64(as, QNAN);
+	EMIT(as, 0x48, 0x21, 0xc8);				// and rax, rcx
+	EMIT(as, 0x48, 0x39, 0xc8);				// cmp rax, rcx
+	return emitJump(as, JE);
+#else
+	EMIT(as, 0x81, 0xbb);					// cmp dword [rbx + disp32], VAL_NUMBER
+	emit32(as, SLOT(slot) + (uint32_t)offsetof(Value, type));
+	emit32(as, VAL_NUMBER);
+	return emitJump(as, JNE);
+#endif
+}
+
+// Guards the two operands on top of the stack, skipping the ones already
+// known to be numbers. Returns how many jumps were stored in guards.
+static int emitOperandGuards(Assembler * as, int guards[2])
+{
+	int count = 0;
+	for (int slot = as->depth - 2; slot < as->depth; slot++)
+	{
+		if (!as->numbers[slot])
+			guards[count++] = emitNumberGuard(as, slot);
+	}
+
+	return count;
+}
+
+// Loads the numbers of the two operands on top of the stack into xmm0 and xmm1.
+static void emitLoadOperands(Assembler * as)
+{
+	EMIT(as, 0xf2, 0x0f, 0x10, 0x83);		// movsd xmm0, [rbx + disp32]
+	emit32(as, SLOT(as->depth - 2) + NUMBER_OFFSET);
+	EMIT(as, 0xf2, 0x0f, 0x10, 0x8b);		// movsd xmm1, [rbx + disp32]
+	emit32(as, SLOT(as->depth - 1) + NUMBER_OFFSET);
+}
+
+// Calls helper with the top of the stack and, if passed, one integer argument.
+// The helper leaves depth values on a stack that may have moved, so rbx is
+// rebased on the top it returns. A NULL top returns NULL from the native code.
+static void emitCall(Assembler * as, void * helper, bool hasArgument, int argument, int depth)
+{
+	EMIT(as, LEA_ARG0_RBX);
+	emit32(as, SLOT(as->depth));
+	if (hasArgument)
+	{
+		EMIT(as, MOV_ARG1_IMM);
+		emit32(as, (uint32_t)argument);
+	}
+
+	EMIT(as, 0x48, 0xb8);					// mov rax, helper
+	emit64(as, (uint64_t)(uintptr_t)helper);
+	EMIT(as, 0xff, 0xd0);					// call rax
+	EMIT(as, 0x48, 0x85, 0xc0);				// test rax, rax
+
+	int ok = emitJump(as, JNE);
+	EMIT(as, 0x31, 0xc0);					// xor eax, eax
+	emitEpilogue(as);
+	patchJump(as, ok);
+
+	EMIT(as, 0x48, 0x8d, 0x98);				// lea rbx, [rax + disp32]
+	emit32(as, (uint32_t)(-depth * VALUE_SIZE));
+	as->depth = depth;
+}
+
+// Numbers are handled inline. Anything else goes to the slow path, which is
+// helper when there is one and the interpreter otherwise.
+static void emitArithmetic(Assembler * as, uint8_t op, void * helper, int offset)
+{
+	int left = as->depth - 2;
+	int guards[2];
+	int guardCount = emitOperandGuards(as, guards);
+
+	emitLoadOperands(as);
+	EMIT(as, 0xf2, 0x0f);					// op xmm0, xmm1
+	emit(as, op);
+	emit(as, 0xc1);
+	EMIT(as, 0xf2, 0x0f, 0x11, 0x83);		// movsd [rbx + disp32], xmm0
+	emit32(as, SLOT(left) + NUMBER_OFFSET);
+
+	if (guardCount > 0)
+	{
+		int done = emitJump(as, JMP);
+		for (int i = 0; i < guardCount; i++)
+			patchJump(as, guards[i]);
+
+		if (helper != NULL)
+			emitCall(as, helper, true, offset, left + 1);
+		else
+			emitExit(as, offset);
+
+		patchJump(as, done);
+	}
+
+	// Only a helper can leave something other than a number behind.
+	as->depth = left + 1;
+	as->numbers[left] = helper == NULL || guardCount == 0;
+}
+
+// Compares two numbers with ucomisd, swapping them for < and <= so every
+// comparison is an unsigned above test and NaN compares false.
+static void emitComparison(Assembler * as, uint8_t condition, bool swap, int offset)
+{
+	int left = as->depth - 2;
+	int guards[2];
+	int guardCount = emitOperandGuards(as, guards);
+
+	emitLoadOperands(as);
+	if (swap)
+		EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);	// ucomisd xmm1, xmm0
+	else
+		EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);	// ucomisd xmm0, xmm1
+
+	int isTrue = emitJump(as, condition);
+	emitStoreValue(as, left, BOOL_VAL(false));
+	int stored = emitJump(as, JMP);
+	patchJump(as, isTrue);
+	emitStoreValue(as, left, BOOL_VAL(true));
+	patchJump(as, stored);
+
+	if (guardCount > 0)
+	{
+		int done = emitJump(as, JMP);
+		for (int i = 0; i < guardCount; i++)
+			patchJump(as, guards[i]);
+
+		emitExit(as, offset);
+		patchJump(as, done);
+	}
+
+	as->depth = left + 1;
+	as->numbers[left] = false;
+}
+
+static void emitNegate(Assembler * as, int offset)
+{
+	int operand = as->depth - 1;
+	int notNumber = as->numbers[operand] ? -1 : emitNumberGuard(as, operand);
+
+	EMIT(as, 0x48, 0x8b, 0x83);				// mov rax, [rbx + disp32]
+	emit32(as, SLOT(operand) + NUMBER_OFFSET);
+	EMIT(as, 0x48, 0x0f, 0xba, 0xf8, 0x3f);	// btc rax, 63
+	EMIT(as, 0x48, 0x89, 0x83);				// mov [rbx + disp32], rax
+	emit32(as, SLOT(operand) + NUMBER_OFFSET);
+
+	if (notNumber != -1)
+	{
+		int done = emitJump(as, JMP);
+		patchJump(as, notNumber);
+		emitExit(as, offset);
+		patchJump(as, done);
+	}
+
+	as->numbers[operand] = true;
+}
+
+static void emitCallOperator(Assembler * as, void * helper, bool hasArgument, int argument, int depth)
+{
+	emitCall(as, helper, hasArgument, argument, depth);
+	as->numbers[depth - 1] = false;
+}
+
+static void assemble(Assembler * as, Chunk * chunk)
+{
+	EMIT(as, 0x53);							// push rbx
+	EMIT(as, 0x41, 0x54);					// push r12
+	EMIT(as, 0x48, 0x83, 0xec, FRAME_SIZE);	// sub rsp, FRAME_SIZE
+	EMIT(as, MOV_RBX_ARG0);
+	EMIT(as, MOV_R12_ARG1);
+
+	for (int offset = 0; offset < chunk->count;)
+	{
+		uint8_t * code = &chunk->code[offset];
+		int depth = as->depth;
+
+		switch (*code)
+		{
+			case OP_CONSTANT:
+				emitPush(as, chunk->constants.values[code[1]]);
+				offset += 2;
+				break;
+
+			case OP_CONSTANT_LONG:
+				emitPush(as, chunk->constants.values[(code[1] << 16) | (code[2] << 8) | code[3]]);
+				offset += 4;
+				break;
+
+			case OP_NIL:	emitPush(as, NIL_VAL); offset++; break;
+			case OP_TRUE:	emitPush(as, BOOL_VAL(true)); offset++; break;
+			case OP_FALSE:	emitPush(as, BOOL_VAL(false)); offset++; break;
+
+			case OP_EQUAL:		emitCallOperator(as, (void *)nativeEqual, true, 0, depth - 1); offset++; break;
+			case OP_NOT_EQUAL:	emitCallOperator(as, (void *)nativeEqual, true, 1, depth - 1); offset++; break;
+
+			case OP_GREATER:		emitComparison(as, JA, false, offset); offset++; break;
+			case OP_GREATER_EQUAL:	emitComparison(as, JAE, false, offset); offset++; break;
+			case OP_LESS:			emitComparison(as, JA, true, offset); offset++; break;
+			case OP_LESS_EQUAL:		emitComparison(as, JAE, true, offset); offset++; break;
+
+			case OP_ADD:
+			case OP_ADD_NUM:
+			case OP_ADD_STR:	emitArithmetic(as, 0x58, (void *)nativeAdd, offset); offset++; break;
+			case OP_SUBTRACT:	emitArithmetic(as, 0x5c, NULL, offset); offset++; break;
+			case OP_MULTIPLY:	emitArithmetic(as, 0x59, NULL, offset); offset++; break;
+			case OP_DIVIDE:		emitArithmetic(as, 0x5e, NULL, offset); offset++; break;
+
+			case OP_NOT:		emitCallOperator(as, (void *)nativeNot, false, 0, depth); offset++; break;
+			case OP_NEGATE:		emitNegate(as, offset); offset++; break;
+
+			default:
+				// OP_RETURN and anything without a template. The code is one
+				// straight line, so nothing after this point can be reached.
+				emitExit(as, offset);
+				return;
+		}
+	}
+}
+
+static void * allocateExecutable(const uint8_t * code, size_t size)
+{
+#if defined(LOX_PLATFORM_WINDOWS)
+	void * memory = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (memory == NULL)
+		return NULL;
+
+	memcpy(memory, code, size);
+
+	DWORD oldProtection;
+	if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &oldProtection))
+	{
+		VirtualFree(memory, 0, MEM_RELEASE);
+		return NULL;
+	}
+
+	FlushInstructionCache(GetCurrentProcess(), memory, size);
+	return memory;
+#else
+	// Written while writable, then flipped to executable so the memory is
+	// never both at once.
+	void * memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return NULL;
+
+	memcpy(memory, code, size);
+
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(memory, size);
+		return NULL;
+	}
+
+	return memory;
+#endif
+}
+
+bool compileNative(Chunk * chunk)
+{
+	Assembler as = { NULL, 0, 0, false, 0, NULL };
+	as.numbers = (bool *)malloc(sizeof(bool) * (chunk->maxStack + 1));
+	if (as.numbers == NULL)
+		return false;
+
+	assemble(&as, chunk);
+
+	void * memory = as.failed ? NULL : allocateExecutable(as.code, (size_t)as.count);
+	free(as.code);
+	free(as.numbers);
+
+	if (memory == NULL)
+		return false;
+
+	chunk->native = (NativeCode)memory;
+	chunk->nativeSize = (size_t)as.count;
+	return true;
+}
+
+void freeNative(Chunk * chunk)
+{
+	if (chunk->native == NULL)
+		return;
+
+#if defined(LOX_PLATFORM_WINDOWS)
+	VirtualFree((void *)chunk->native, 0, MEM_RELEASE);
+#else
+	munmap((void *)chunk->native, chunk->nativeSize);
+#endif
+
+	chunk->native = NULL;
+	chunk->nativeSize = 0;
+}
+
+#else
+
+// No code generator for this target, everything runs in the interpreter.
+bool compileNative(Chunk * chunk)
+{
+	return false;
+}
+
+void freeNative(Chunk * chunk)
+{
+}
+
+#endif
+
+#endif
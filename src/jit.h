@@ -0,0 +1,28 @@
+#ifndef LOX_JIT_H
+#define LOX_JIT_H
+
+#include "chunk.h"
+
+
+// A chunk run this many times by the same VM is compiled to native code, can
+// be overridden on the compiler command line. Shared scripts are compiled as
+// soon as they are added to their pool.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 8
+#endif
+
+
+// Translates the code of chunk to native code, one template per opcode. Fails
+// when there is no code generator for the target or no executable memory, in
+// which case the chunk stays with the interpreter.
+bool compileNative(Chunk * chunk);
+void freeNative(Chunk * chunk);
+
+// Called from native code, defined in vm.c. Each takes the top of the stack,
+// runs one instruction and returns the new top, or NULL after reporting a
+// runtime error for the instruction at offset.
+Value * nativeAdd(Value * sp, int offset);
+Value * nativeEqual(Value * sp, int negate);
+Value * nativeNot(Value * sp);
+
+#endif
@@ -1,94 +1,458 @@
 
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(LOX_PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "mapfile.h"
+#include "pool.h"
+#include "timer.h"
+#include "trace.h"
 #include "vm.h"
 
 
-static void repl()
+// Reads one line of any length into buffer, growing it as needed. Returns false
+// once the input has ended.
+static bool readLine(char ** buffer, size_t * capacity)
 {
-	char line[1024];
+	size_t length = 0;
+
+	for (;;)
+	{
+		if (*capacity - length < 2)
+		{
+			*capacity = *capacity < 256 ? 256 : *capacity * 2;
+			*buffer = (char *)realloc(*buffer, *capacity);
+			if (*buffer == NULL)
+			{
+				fprintf(stderr, "Not enough memory to read the line.\n");
+				exit(74);
+			}
+		}
+
+		size_t room = *capacity - length;
+		if (room > INT_MAX)
+			room = INT_MAX;
+
+		if (!fgets(*buffer + length, (int)room, stdin))
+			return length > 0;
+
+		length += strlen(*buffer + length);
+		if (length > 0 && (*buffer)[length - 1] == '\n')
+			return true;
+	}
+}
+
+static void repl(VM * instance)
+{
+	char * line = NULL;
+	size_t capacity = 0;
 
 	for (;;)
 	{
 		printf("> ");
 
-		if (!fgets(line, sizeof(line), stdin))
+		if (!readLine(&line, &capacity))
 		{
 			printf("\n");
 			break;
 		}
 
-		interpret(line);
+		interpretLineIn(instance, line);
 	}
+
+	free(line);
 }
 
-static char * readFile(const char * path)
+// Reads a length line followed by that many bytes of source into buffer. One
+// newline right after the source is skipped, so "%zu\n%s\n" frames are read
+// as well as ones with nothing between them. Returns false once the input has
+// ended.
+static bool readSized(char ** buffer, size_t * capacity)
 {
-	FILE * file = fopen(path, "rb");
-	if (file == NULL)
+	if (!readLine(buffer, capacity))
+		return false;
+
+	char * end;
+	unsigned long long length = strtoull(*buffer, &end, 10);
+	if (end == *buffer || (*end != '\n' && *end != '\0') || length >= SIZE_MAX)
 	{
-		fprintf(stderr, "Could not open file \"%s\".\n", path);
-		exit(74);
+		fprintf(stderr, "Expected the length of the next expression.\n");
+		exit(65);
+	}
+
+	if (*capacity < length + 1)
+	{
+		*capacity = (size_t)length + 1;
+		*buffer = (char *)realloc(*buffer, *capacity);
+		if (*buffer == NULL)
+		{
+			fprintf(stderr, "Not enough memory to read the expression.\n");
+			exit(74);
+		}
+	}
+
+	if (fread(*buffer, 1, (size_t)length, stdin) != length)
+	{
+		fprintf(stderr, "The input ended inside an expression.\n");
+		exit(65);
+	}
+
+	(*buffer)[length] = '\0';
+
+	int next = getchar();
+	if (next != '\n' && next != EOF)
+		ungetc(next, stdin);
+
+	return true;
+}
+
+// Evaluates every expression on stdin in one session, one per line or each
+// preceded by its length when sized. Prints one line per expression, an empty
+// one when it fails, so results can be matched up with the input. Returns the
+// first failure.
+static InterpretResult batch(VM * instance, bool sized)
+{
+	static char output[1 << 16];
+	setvbuf(stdout, output, _IOFBF, sizeof(output));
+
+	char * source = NULL;
+	size_t capacity = 0;
+	InterpretResult result = INTERPRET_OK;
+
+	while (sized ? readSized(&source, &capacity) : readLine(&source, &capacity))
+	{
+		InterpretResult expression = interpretLineIn(instance, source);
+		if (expression != INTERPRET_OK)
+		{
+			printf("\n");
+			if (result == INTERPRET_OK)
+				result = expression;
+		}
 	}
 
-	fseek(file, 0, SEEK_END);
-	size_t fileSize = ftell(file);
-	rewind(file);
+	fflush(stdout);
+	free(source);
+	return result;
+}
 
-	char * buffer = (char *)malloc(fileSize + 1);
-	if (buffer == NULL)
+static void readFile(const char * path, MappedFile * file)
+{
+	if (!openMappedFile(path, file))
 	{
-		fprintf(stderr, "Not enought memory to read \"%s\".\n", path);
+		fprintf(stderr, "Could not read file \"%s\".\n", path);
 		exit(74);
 	}
-	
-	size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-	if (bytesRead < fileSize)
+}
+
+static InterpretResult runFile(VM * instance, const char * path, bool useCache)
+{
+	MappedFile file;
+	readFile(path, &file);
+
+	const char * source = file.data;
+	InterpretResult result;
+
+	if (useCache)
+	{
+		// The cache lives next to the script, "script.lox" uses "script.loxc".
+		size_t length = strlen(path);
+		char * cachePath = (char *)malloc(length + 2);
+		memcpy(cachePath, path, length);
+		cachePath[length] = 'c';
+		cachePath[length + 1] = '\0';
+
+		result = interpretCachedIn(instance, source, cachePath);
+		free(cachePath);
+	}
+	else
+	{
+		result = interpretIn(instance, source);
+	}
+
+	closeMappedFile(&file);
+	return result;
+}
+
+// One of the VMs started by runJobs(), running the shared script on a thread of
+// its own.
+typedef struct {
+	SharedScript * script;
+	InterpretResult result;
+} Job;
+
+#if defined(LOX_PLATFORM_WINDOWS)
+typedef HANDLE Thread;
+#define JOB_FUNCTION(name, argument) DWORD WINAPI name(LPVOID argument)
+#define JOB_RETURN 0
+#else
+typedef pthread_t Thread;
+#define JOB_FUNCTION(name, argument) void * name(void * argument)
+#define JOB_RETURN NULL
+#endif
+
+static void runJob(Job * job)
+{
+	VM * instance = newVM();
+	if (instance == NULL)
+	{
+		fprintf(stderr, "Not enough memory to create the VM.\n");
+		job->result = INTERPRET_RUNTIME_ERROR;
+		return;
+	}
+
+	job->result = interpretSharedIn(instance, job->script);
+	freeVM(instance);
+}
+
+static JOB_FUNCTION(jobThread, argument)
+{
+	runJob((Job *)argument);
+	return JOB_RETURN;
+}
+
+static bool startJob(Thread * thread, Job * job)
+{
+#if defined(LOX_PLATFORM_WINDOWS)
+	*thread = CreateThread(NULL, 0, jobThread, job, 0, NULL);
+	return *thread != NULL;
+#else
+	return pthread_create(thread, NULL, jobThread, job) == 0;
+#endif
+}
+
+static void joinJob(Thread thread)
+{
+#if defined(LOX_PLATFORM_WINDOWS)
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
+// Runs the script in the given number of VMs at once, each on its own thread.
+// The script is compiled once, into a pool, and every VM runs the shared chunk.
+// Returns the first failure.
+static InterpretResult runJobs(const char * path, int jobs, bool foldConstants)
+{
+	MappedFile file;
+	readFile(path, &file);
+
+	ScriptPool * pool = newScriptPool(foldConstants);
+	Job * list = (Job *)malloc(sizeof(Job) * jobs);
+	Thread * threads = (Thread *)malloc(sizeof(Thread) * jobs);
+	bool * started = (bool *)malloc(sizeof(bool) * jobs);
+	if (pool == NULL || list == NULL || threads == NULL || started == NULL)
 	{
-		fprintf(stderr, "Count not read file \"%s\".\n", path);
+		fprintf(stderr, "Not enough memory to start the jobs.\n");
 		exit(74);
 	}
 
-	buffer[bytesRead] = '\0';
+	SharedScript * script = acquireScript(pool, file.data);
+	closeMappedFile(&file);
 
-	fclose(file);
-	return buffer;
+	InterpretResult result = INTERPRET_COMPILE_ERROR;
+	if (script != NULL)
+	{
+		for (int i = 0; i < jobs; i++)
+		{
+			list[i].script = script;
+			started[i] = startJob(&threads[i], &list[i]);
+		}
+
+		// A job that could not get a thread runs on this one instead.
+		result = INTERPRET_OK;
+		for (int i = 0; i < jobs; i++)
+		{
+			if (started[i])
+				joinJob(threads[i]);
+			else
+				runJob(&list[i]);
+
+			if (result == INTERPRET_OK)
+				result = list[i].result;
+		}
+
+		releaseScript(pool, script);
+	}
+
+	fflush(stdout);
+	freeScriptPool(pool);
+	free(list);
+	free(threads);
+	free(started);
+	return result;
 }
 
-static void runFile(const char * path)
+#ifdef LOX_BENCH
+static uint64_t countAllocations(HeapStats * stats)
 {
-	char * source = readFile(path);
-	InterpretResult result = interpret(source);
-	free(source);
+	uint64_t allocations = 0;
+	for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+		allocations += stats->categories[i].allocations;
+	return allocations;
+}
 
-	if (result == INTERPRET_COMPILE_ERROR) exit(65);
-	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+static void printJsonString(FILE * out, const char * string)
+{
+	fputc('"', out);
+	for (const char * c = string; *c != '\0'; c++)
+	{
+		if (*c == '"' || *c == '\\')
+			fputc('\\', out);
+		fputc(*c, out);
+	}
+	fputc('"', out);
 }
 
-int main(int argc, const char * argv[])
+// Runs the script the given number of times and reports the averages as one
+// line of JSON on stderr, leaving stdout to the script.
+static InterpretResult benchFile(VM * instance, const char * path, int runs)
 {
-	initVM();
+	MappedFile file;
+	readFile(path, &file);
 
-	if (argc == 1)
+	uint64_t allocations = countAllocations(&instance->heap);
+	instance->instructionCount = 0;
+
+	InterpretResult result = INTERPRET_OK;
+	int completed = 0;
+	uint64_t start = timerNanoseconds();
+
+	while (completed < runs && result == INTERPRET_OK)
 	{
-		repl();
+		result = interpretIn(instance, file.data);
+		completed++;
 	}
-	else if (argc == 2)
+
+	uint64_t elapsed = timerNanoseconds() - start;
+	allocations = countAllocations(&instance->heap) - allocations;
+	closeMappedFile(&file);
+
+	double seconds = elapsed / 1e9;
+	fprintf(stderr, "{\"script\": ");
+	printJsonString(stderr, path);
+	fprintf(stderr, ", \"runs\": %d, \"ok\": %s, \"wall_ns\": %" PRIu64 ", \"ns_per_run\": %" PRIu64
+		", \"instructions_per_run\": %" PRIu64 ", \"instructions_per_second\": %.0f, \"allocations_per_run\": %" PRIu64 "}\n",
+		completed, result == INTERPRET_OK ? "true" : "false", elapsed, elapsed / completed,
+		instance->instructionCount / completed, seconds > 0 ? instance->instructionCount / seconds : 0.0,
+		allocations / completed);
+
+	return result;
+}
+#endif
+
+static void usage()
+{
+#ifdef LOX_BENCH
+	fprintf(stderr, "Usage: lox [--cache] [--heap-stats] [--trace-exec] [--dump-bytecode] [--trace-parse] [--trace-jit] [--no-fold] [--bench runs] [--jobs count] [--batch | --batch-sized | path]\n");
+#else
+	fprintf(stderr, "Usage: lox [--cache] [--heap-stats] [--trace-exec] [--dump-bytecode] [--trace-parse] [--trace-jit] [--no-fold] [--jobs count] [--batch | --batch-sized | path]\n");
+#endif
+	exit(64);
+}
+
+int main(int argc, const char * argv[])
+{
+	bool heapStats = false;
+	bool useCache = false;
+	bool foldConstants = true;
+	int traces = 0;
+	bool batchMode = false;
+	bool sized = false;
+	int jobs = 0;
+#ifdef LOX_BENCH
+	int benchRuns = 0;
+#endif
+	const char * path = NULL;
+
+	for (int i = 1; i < argc; i++)
 	{
-		runFile(argv[1]);
+		if (strcmp(argv[i], "--cache") == 0)
+			useCache = true;
+		else if (strcmp(argv[i], "--heap-stats") == 0)
+			heapStats = true;
+		else if (strcmp(argv[i], "--trace-exec") == 0)
+			traces |= TRACE_FLAG_EXECUTION;
+		else if (strcmp(argv[i], "--dump-bytecode") == 0)
+			traces |= TRACE_FLAG_BYTECODE;
+		else if (strcmp(argv[i], "--trace-parse") == 0)
+			traces |= TRACE_FLAG_PARSE;
+		else if (strcmp(argv[i], "--trace-jit") == 0)
+			traces |= TRACE_FLAG_JIT;
+		else if (strcmp(argv[i], "--no-fold") == 0)
+			foldConstants = false;
+		else if (strcmp(argv[i], "--batch") == 0)
+			batchMode = true;
+		else if (strcmp(argv[i], "--batch-sized") == 0)
+			batchMode = sized = true;
+		else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			jobs = atoi(argv[++i]);
+#ifdef LOX_BENCH
+		else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			benchRuns = atoi(argv[++i]);
+#endif
+		else if (argv[i][0] == '-' || path != NULL)
+			usage();
+		else
+			path = argv[i];
 	}
-	else
+
+	if (batchMode && path != NULL)
+		usage();
+
+	// Jobs run on VMs of their own, which neither use the cache nor report
+	// their heap.
+	if (jobs > 0 && (path == NULL || useCache || heapStats))
+		usage();
+#ifdef LOX_BENCH
+	if (jobs > 0 && benchRuns > 0)
+		usage();
+#endif
+
+	initTrace(traces);
+	VM * instance = newVM();
+	if (instance == NULL)
 	{
-		fprintf(stderr, "Usage: lox [path]\n");
-		exit(64);
+		fprintf(stderr, "Not enough memory to create the VM.\n");
+		exit(74);
 	}
 
-	freeVM();
+	instance->foldConstants = foldConstants;
+
+	InterpretResult result = INTERPRET_OK;
+	if (batchMode)
+		result = batch(instance, sized);
+	else if (path == NULL)
+		repl(instance);
+	else if (jobs > 0)
+		result = runJobs(path, jobs, foldConstants);
+#ifdef LOX_BENCH
+	else if (benchRuns > 0)
+		result = benchFile(instance, path, benchRuns);
+#endif
+	else
+		result = runFile(instance, path, useCache);
+
+	if (heapStats)
+		printHeapStats(&instance->heap);
+
+	freeVM(instance);
+	flushTrace();
+
+	if (result == INTERPRET_COMPILE_ERROR) exit(65);
+	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 
 	return 0;
 }
\ No newline at end of file
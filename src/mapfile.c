@@ -0,0 +1,188 @@
+
+#if !defined(LOX_PLATFORM_WINDOWS)
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if !defined(LOX_PLATFORM_WINDOWS)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define LOX_MMAP
+#else
+#include <windows.h>
+#endif
+
+#include "mapfile.h"
+
+
+static bool readWholeFile(const char * path, MappedFile * file)
+{
+	FILE * handle = fopen(path, "rb");
+	if (handle == NULL)
+		return false;
+
+	fseek(handle, 0, SEEK_END);
+	size_t fileSize = ftell(handle);
+	rewind(handle);
+
+	char * buffer = (char *)malloc(fileSize + 1);
+	if (buffer == NULL)
+	{
+		fclose(handle);
+		return false;
+	}
+
+	size_t bytesRead = fread(buffer, sizeof(char), fileSize, handle);
+	fclose(handle);
+
+	if (bytesRead < fileSize)
+	{
+		free(buffer);
+		return false;
+	}
+
+	buffer[bytesRead] = '\0';
+
+	file->data = buffer;
+	file->size = bytesRead;
+	file->mappedSize = 0;
+	file->mapped = false;
+	return true;
+}
+
+#ifdef LOX_MMAP
+static bool mapWholeFile(const char * path, MappedFile * file)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+	{
+		close(fd);
+		return false;
+	}
+
+	// Reserve one byte more than the file, rounded up to whole pages, as zeroed
+	// anonymous memory and map the file over the start of it. Whatever follows
+	// the file, the rest of its last page or the extra page, reads as '\0'.
+	size_t size = (size_t)info.st_size;
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t mappedSize = (size + 1 + pageSize - 1) & ~(pageSize - 1);
+
+	void * base = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		close(fd);
+		return false;
+	}
+
+	if (size > 0 && mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+		munmap(base, mappedSize);
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	file->data = (const char *)base;
+	file->size = size;
+	file->mappedSize = mappedSize;
+	file->mapped = true;
+	return true;
+}
+#endif
+
+#ifdef LOX_PLATFORM_WINDOWS
+static bool mapWholeFile(const char * path, MappedFile * file)
+{
+	HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (GetFileType(handle) != FILE_TYPE_DISK || !GetFileSizeEx(handle, &fileSize) ||
+		(unsigned long long)fileSize.QuadPart > (SIZE_MAX - 1))
+	{
+		CloseHandle(handle);
+		return false;
+	}
+
+	// A view can't reach past the end of a read-only file, so the '\0' after
+	// the data has to come from the zeroed rest of the last page. Empty files
+	// and files that end on a page boundary have no such byte and are read
+	// instead.
+	SYSTEM_INFO system;
+	GetSystemInfo(&system);
+
+	size_t size = (size_t)fileSize.QuadPart;
+	if (size == 0 || size % system.dwPageSize == 0)
+	{
+		CloseHandle(handle);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle);
+	if (mapping == NULL)
+		return false;
+
+	// The view keeps the mapping, and through it the file, open.
+	void * base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (base == NULL)
+		return false;
+
+	file->data = (const char *)base;
+	file->size = size;
+	file->mappedSize = size;
+	file->mapped = true;
+	return true;
+}
+#endif
+
+bool openMappedFile(const char * path, MappedFile * file)
+{
+#if defined(LOX_MMAP) || defined(LOX_PLATFORM_WINDOWS)
+	if (mapWholeFile(path, file))
+		return true;
+#endif
+
+	return readWholeFile(path, file);
+}
+
+void closeMappedFile(MappedFile * file)
+{
+#if defined(LOX_MMAP)
+	if (file->mapped)
+		munmap((void *)file->data, file->mappedSize);
+	else
+		free((void *)file->data);
+#elif defined(LOX_PLATFORM_WINDOWS)
+	if (file->mapped)
+		UnmapViewOfFile(file->data);
+	else
+		free((void *)file->data);
+#else
+	free((void *)file->data);
+#endif
+
+	file->data = NULL;
+	file->size = 0;
+	file->mappedSize = 0;
+	file->mapped = false;
+}
@@ -0,0 +1,25 @@
+#ifndef LOX_MAPFILE_H
+#define LOX_MAPFILE_H
+
+#include "common.h"
+
+
+// A read-only view of a whole file. Where the platform supports it the file is
+// memory mapped, otherwise it is read into a heap buffer. Either way data is
+// followed by a '\0' so the scanner can run over it directly.
+//
+// Mapping saves copying the file into a buffer before it is scanned or read.
+// It does not share memory between processes: the compiler and the cache
+// reader copy everything they keep into the chunk before the file is closed.
+typedef struct {
+	const char * data;
+	size_t size;
+	size_t mappedSize;
+	bool mapped;
+} MappedFile;
+
+
+bool openMappedFile(const char * path, MappedFile * file);
+void closeMappedFile(MappedFile * file);
+
+#endif
@@ -1,11 +1,148 @@
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
+#include "compiler.h"
 #include "memory.h"
+#include "timer.h"
 #include "vm.h"
 
-void * reallocate(void * previous, size_t oldSize, size_t newSize)
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+static void trackCounter(MemoryCounter * counter, size_t oldSize, size_t newSize)
+{
+    counter->bytes += newSize - oldSize;
+    if (counter->bytes > counter->peakBytes)
+        counter->peakBytes = counter->bytes;
+    if (newSize > oldSize)
+        counter->allocations++;
+}
+
+static void trackAllocation(MemoryCategory category, size_t oldSize, size_t newSize)
+{
+    vm->heap.bytesAllocated += newSize - oldSize;
+    if (vm->heap.bytesAllocated > vm->heap.peakBytesAllocated)
+        vm->heap.peakBytesAllocated = vm->heap.bytesAllocated;
+
+    trackCounter(&vm->heap.categories[category], oldSize, newSize);
+}
+
+void initHeapStats(HeapStats * stats)
+{
+    memset(stats, 0, sizeof(HeapStats));
+}
+
+// Upper bound in microseconds of the bucket holding the given percentile.
+static uint64_t pausePercentile(HeapStats * stats, double percentile)
+{
+    size_t pauses = stats->collections + stats->minorCollections;
+    size_t seen = 0;
+
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        seen += stats->pauseHistogram[i];
+        if (seen >= pauses * percentile)
+            return (uint64_t)1 << i;
+    }
+
+    return (uint64_t)1 << (GC_PAUSE_BUCKETS - 1);
+}
+
+static void printCounter(const char * name, MemoryCounter * counter)
+{
+    fprintf(stderr, "  %-12s %12zu %12zu %12zu\n", name, counter->bytes, counter->peakBytes, counter->allocations);
+}
+
+void printHeapStats(HeapStats * stats)
+{
+    static const char * categoryNames[MEM_CATEGORY_COUNT] = {
+        "objects",
+        "strings",
+        "code",
+        "lines",
+        "constants",
+        "tables",
+        "stack",
+    };
+
+    fprintf(stderr, "== heap ==\n");
+    fprintf(stderr, "  %-12s %12s %12s %12s\n", "category", "live", "peak", "allocs");
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+        printCounter(categoryNames[i], &stats->categories[i]);
+
+    fprintf(stderr, "  %-12s %12zu %12zu\n", "total", stats->bytesAllocated, stats->peakBytesAllocated);
+    printCounter("arena", &stats->arenaBytes);
+    fprintf(stderr, "  %-12s %12zu collections, %zu minor, %zu bytes freed\n", "gc",
+            stats->collections, stats->minorCollections, stats->bytesFreed);
+
+    size_t pauses = stats->collections + stats->minorCollections;
+    if (pauses == 0)
+        return;
+
+    fprintf(stderr, "== gc pauses ==\n");
+    fprintf(stderr, "  total %.3fms, mean %.3fus, max %.3fus, p50 < %lluus, p99 < %lluus\n",
+            stats->pauseTotalNs / 1e6,
+            stats->pauseTotalNs / 1e3 / pauses,
+            stats->pauseMaxNs / 1e3,
+            (unsigned long long)pausePercentile(stats, 0.50),
+            (unsigned long long)pausePercentile(stats, 0.99));
+
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        if (stats->pauseHistogram[i] == 0)
+            continue;
+
+        fprintf(stderr, "  < %10lluus %12zu\n", (unsigned long long)1 << i, stats->pauseHistogram[i]);
+    }
+}
+
+static void recordPause(HeapStats * stats, uint64_t nanoseconds)
+{
+    stats->pauseTotalNs += nanoseconds;
+    if (nanoseconds > stats->pauseMaxNs)
+        stats->pauseMaxNs = nanoseconds;
+
+    int bucket = 0;
+    for (uint64_t microseconds = nanoseconds / 1000; microseconds > 0; microseconds >>= 1)
+        bucket++;
+
+    if (bucket >= GC_PAUSE_BUCKETS)
+        bucket = GC_PAUSE_BUCKETS - 1;
+
+    stats->pauseHistogram[bucket]++;
+}
+
+static void collectIfNeeded(size_t oldSize, size_t newSize, MemoryCategory category)
+{
+    if (newSize > oldSize)
+    {
+#ifdef LOX_GC_GENERATIONAL
+        if (category == MEM_OBJECT || category == MEM_STRING)
+            vm->nurseryBytes += newSize - oldSize;
+#else
+        (void)category;
+#endif
+
+#if defined(DEBUG_STRESS_GC) && defined(LOX_GC_GENERATIONAL)
+        collectNursery();
+#elif defined(DEBUG_STRESS_GC)
+        collectGarbage();
+#else
+        if (vm->heap.bytesAllocated > vm->nextGC)
+            collectGarbage();
+#ifdef LOX_GC_GENERATIONAL
+        else if (vm->nurseryBytes > GC_NURSERY_SIZE)
+            collectNursery();
+#endif
+#endif
+    }
+}
+
+static void * resize(void * previous, size_t newSize)
 {
     if (newSize == 0)
     {
@@ -16,26 +153,491 @@ void * reallocate(void * previous, size_t oldSize, size_t newSize)
     return realloc(previous, newSize);
 }
 
+void * reallocate(void * previous, size_t oldSize, size_t newSize, MemoryCategory category)
+{
+    trackAllocation(category, oldSize, newSize);
+    collectIfNeeded(oldSize, newSize, category);
+    return resize(previous, newSize);
+}
+
+void * reallocateNoGC(void * previous, size_t oldSize, size_t newSize, MemoryCategory category)
+{
+    trackAllocation(category, oldSize, newSize);
+    return resize(previous, newSize);
+}
+
+void * allocateStringBlock(int length)
+{
+    if (length > SMALL_STRING_LENGTH)
+        return reallocate(NULL, 0, STRING_SIZE(length), MEM_STRING);
+
+    size_t size = STRING_SIZE(SMALL_STRING_LENGTH);
+    if (vm->smallStrings == NULL)
+        return reallocate(NULL, 0, size, MEM_STRING);
+
+    trackAllocation(MEM_STRING, 0, size);
+    collectIfNeeded(0, size, MEM_STRING);
+
+    Obj * block = vm->smallStrings;
+    vm->smallStrings = block->next;
+    return block;
+}
+
+void freeStringBlock(ObjString * string)
+{
+    if (string->length > SMALL_STRING_LENGTH)
+    {
+        reallocate(string, STRING_SIZE(string->length), 0, MEM_STRING);
+        return;
+    }
+
+    trackAllocation(MEM_STRING, STRING_SIZE(SMALL_STRING_LENGTH), 0);
+
+    Obj * block = &string->obj;
+    block->next = vm->smallStrings;
+    vm->smallStrings = block;
+}
+
+// Size of a fresh arena block, larger requests get a block of their own.
+#define ARENA_BLOCK_SIZE    (16 * 1024)
+
+#define ARENA_ALIGN(size) \
+    (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+void initArena(Arena * arena)
+{
+    arena->blocks = NULL;
+    arena->bytesAllocated = 0;
+    arena->allocations = 0;
+}
+
+void freeArena(Arena * arena)
+{
+    ArenaBlock * block = arena->blocks;
+    while (block != NULL)
+    {
+        ArenaBlock * next = block->next;
+        trackCounter(&vm->heap.arenaBytes, sizeof(ArenaBlock) + block->capacity, 0);
+        free(block);
+        block = next;
+    }
+
+    initArena(arena);
+}
+
+void resetArena(Arena * arena)
+{
+    if (arena->blocks == NULL)
+        return;
+
+    // If the last round spilled into several blocks, replace them with a single
+    // block large enough to hold all of it so the next round never has to grow.
+    if (arena->blocks->next != NULL)
+    {
+        size_t capacity = 0;
+        for (ArenaBlock * block = arena->blocks; block != NULL; block = block->next)
+            capacity += block->capacity;
+
+        freeArena(arena);
+
+        arena->blocks = (ArenaBlock *)malloc(sizeof(ArenaBlock) + capacity);
+        if (arena->blocks == NULL)
+            exit(1);
+
+        trackCounter(&vm->heap.arenaBytes, 0, sizeof(ArenaBlock) + capacity);
+
+        arena->blocks->next = NULL;
+        arena->blocks->capacity = capacity;
+    }
+
+    arena->blocks->used = 0;
+    arena->bytesAllocated = 0;
+    arena->allocations = 0;
+}
+
+static void * arenaAllocate(Arena * arena, size_t size)
+{
+    size = ARENA_ALIGN(size);
+
+    ArenaBlock * block = arena->blocks;
+    if (block == NULL || block->capacity - block->used < size)
+    {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + capacity);
+        if (block == NULL)
+            exit(1);
+
+        trackCounter(&vm->heap.arenaBytes, 0, sizeof(ArenaBlock) + capacity);
+
+        block->next = arena->blocks;
+        block->capacity = capacity;
+        block->used = 0;
+        arena->blocks = block;
+    }
+
+    void * result = block->data + block->used;
+    block->used += size;
+    arena->bytesAllocated += size;
+    arena->allocations++;
+    return result;
+}
+
+void * arenaReallocate(Arena * arena, void * previous, size_t oldSize, size_t newSize, MemoryCategory category)
+{
+    if (arena == NULL)
+        return reallocate(previous, oldSize, newSize, category);
+
+    trackAllocation(category, oldSize, newSize);
+
+    // Frees and shrinks keep their space until the arena is reset.
+    if (newSize == 0)
+        return NULL;
+    if (previous != NULL && newSize <= oldSize)
+        return previous;
+
+    // The most recent allocation can grow in place while the block has room.
+    ArenaBlock * block = arena->blocks;
+    if (previous != NULL && block != NULL &&
+        (uint8_t *)previous + ARENA_ALIGN(oldSize) == block->data + block->used)
+    {
+        size_t offset = (uint8_t *)previous - block->data;
+        if (ARENA_ALIGN(newSize) <= block->capacity - offset)
+        {
+            size_t grown = ARENA_ALIGN(newSize) - ARENA_ALIGN(oldSize);
+            block->used += grown;
+            arena->bytesAllocated += grown;
+            return previous;
+        }
+    }
+
+    void * result = arenaAllocate(arena, newSize);
+    if (previous != NULL)
+        memcpy(result, previous, oldSize < newSize ? oldSize : newSize);
+
+    return result;
+}
+
 static void freeObject(Obj * object)
 {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void *)object, object->type);
+#endif
+
+    switch (object->type)
+    {
+        case OBJ_STRING:
+            freeStringBlock((ObjString *)object);
+            break;
+
+        case OBJ_ROPE:
+            FREE(ObjRope, object, MEM_OBJECT);
+            break;
+    }
+}
+
+void markObject(Obj * object)
+{
+    if (object == NULL || object->isMarked)
+        return;
+
+#ifdef LOX_GC_GENERATIONAL
+    // A minor collection only traces the nursery. Objects only point at older
+    // ones, except for flattened ropes, which flattenString() records in the
+    // remembered set.
+    if (vm->minorCollection && object->isOld)
+        return;
+#endif
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->isMarked = true;
+
+    if (vm->grayCapacity < vm->grayCount + 1)
+    {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+
+        // The gray stack uses the system allocator directly so growing it can
+        // never start a nested collection.
+        vm->grayStack = (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
+        if (vm->grayStack == NULL)
+            exit(1);
+    }
+
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(Value value)
+{
+    if (IS_OBJ(value))
+        markObject(AS_OBJ(value));
+}
+
+void markArray(ValueArray * array)
+{
+    for (int i = 0; i < array->count; i++)
+        markValue(array->values[i]);
+}
+
+static void blackenObject(Obj * object)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
     switch (object->type)
     {
-        case OBJ_STRING: {
-                ObjString * string = (ObjString *)object;
-                FREE_ARRAY(char, string->chars, string->length + 1);
-                FREE(ObjString, object);
-            }
+        case OBJ_STRING:
+            // Strings do not reference other objects.
             break;
+
+        case OBJ_ROPE: {
+            ObjRope * rope = (ObjRope *)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj *)rope->flat);
+            break;
+        }
+    }
+}
+
+static void markRoots()
+{
+    for (Value * slot = vm->stack; slot < vm->stackTop; slot++)
+        markValue(*slot);
+
+    if (vm->chunk != NULL)
+        markArray(&vm->chunk->constants);
+
+    // The session keeps its constants between lines, when nothing else does.
+    markArray(&vm->session.constants);
+    for (int i = 0; i < HOT_LINE_COUNT; i++)
+        markArray(&vm->hotLines[i].chunk.constants);
+
+    markCompilerRoots();
+}
+
+static void traceReferences()
+{
+    while (vm->grayCount > 0)
+    {
+        Obj * object = vm->grayStack[--vm->grayCount];
+        blackenObject(object);
     }
 }
 
+static void sweep()
+{
+    Obj * previous = NULL;
+    Obj * object = vm->objects;
+
+    while (object != NULL)
+    {
+        if (object->isMarked)
+        {
+            object->isMarked = false;
+            previous = object;
+            object = object->next;
+        }
+        else
+        {
+            Obj * unreached = object;
+            object = object->next;
+
+            if (previous != NULL)
+                previous->next = object;
+            else
+                vm->objects = object;
+
+            freeObject(unreached);
+        }
+    }
+}
+
+#ifdef LOX_GC_GENERATIONAL
+// Moves every young object into the old generation.
+static void promoteNursery()
+{
+    Obj * object = vm->youngObjects;
+    while (object != NULL)
+    {
+        Obj * next = object->next;
+        object->isOld = true;
+        object->next = vm->objects;
+        vm->objects = object;
+        object = next;
+    }
+
+    vm->youngObjects = NULL;
+    vm->nurseryBytes = 0;
+}
+
+// Frees unmarked young objects and promotes the survivors. Dead strings are
+// dropped from the intern table one by one, so the cost of a minor collection
+// only depends on the size of the nursery.
+static void sweepNursery()
+{
+    Obj * object = vm->youngObjects;
+    while (object != NULL)
+    {
+        Obj * next = object->next;
+
+        if (object->isMarked)
+        {
+            object->isMarked = false;
+            object->isOld = true;
+            object->next = vm->objects;
+            vm->objects = object;
+        }
+        else
+        {
+#ifdef LOX_LAZY_INTERN
+            if (object->type == OBJ_STRING && ((ObjString *)object)->isInterned)
+#else
+            if (object->type == OBJ_STRING)
+#endif
+                tableDelete(&vm->strings, (ObjString *)object);
+
+            freeObject(object);
+        }
+
+        object = next;
+    }
+
+    vm->youngObjects = NULL;
+    vm->nurseryBytes = 0;
+}
+
+void collectNursery()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+#endif
+
+    uint64_t start = timerNanoseconds();
+    size_t before = vm->heap.bytesAllocated;
+
+    vm->minorCollection = true;
+    markRoots();
+
+    // Old objects that may point into the nursery act as extra roots. Every
+    // survivor is promoted, so the set starts over empty afterwards.
+    for (int i = 0; i < vm->rememberedCount; i++)
+        blackenObject(vm->remembered[i]);
+    vm->rememberedCount = 0;
+
+    traceReferences();
+    sweepNursery();
+    vm->minorCollection = false;
+
+    vm->heap.minorCollections++;
+    vm->heap.bytesFreed += before - vm->heap.bytesAllocated;
+    recordPause(&vm->heap, timerNanoseconds() - start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+           before - vm->heap.bytesAllocated, before, vm->heap.bytesAllocated);
+#endif
+}
+#endif
+
+void collectGarbage()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+
+    uint64_t start = timerNanoseconds();
+    size_t before = vm->heap.bytesAllocated;
+
+#ifdef LOX_GC_GENERATIONAL
+    // A full collection treats the whole heap as one generation.
+    promoteNursery();
+    vm->rememberedCount = 0;
+#endif
+
+    markRoots();
+    traceReferences();
+
+    // The intern table holds its strings weakly.
+    tableRemoveWhite(&vm->strings);
+    sweep();
+
+    vm->nextGC = vm->heap.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm->nextGC < GC_INITIAL_THRESHOLD)
+        vm->nextGC = GC_INITIAL_THRESHOLD;
+
+    vm->heap.collections++;
+    vm->heap.bytesFreed += before - vm->heap.bytesAllocated;
+    recordPause(&vm->heap, timerNanoseconds() - start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm->heap.bytesAllocated, before, vm->heap.bytesAllocated, vm->nextGC);
+#endif
+}
+
+#ifdef LOX_GC_GENERATIONAL
+void rememberObject(Obj * object)
+{
+    if (vm->rememberedCapacity < vm->rememberedCount + 1)
+    {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+
+        // Like the gray stack, this must never start a collection.
+        vm->remembered = (Obj **)realloc(vm->remembered, sizeof(Obj *) * vm->rememberedCapacity);
+        if (vm->remembered == NULL)
+            exit(1);
+    }
+
+    vm->remembered[vm->rememberedCount++] = object;
+}
+#endif
+
+// Marks every object of the VM as permanently reachable. Used once a VM's heap
+// is shared read-only: the collectors of other VMs stop at marked objects, so
+// nothing ever writes to them again.
+void freezeObjects()
+{
+#ifdef LOX_GC_GENERATIONAL
+    promoteNursery();
+#endif
+
+    for (Obj * object = vm->objects; object != NULL; object = object->next)
+        object->isMarked = true;
+}
+
 void freeObjects()
 {
-    Obj * object = vm.objects;
+#ifdef LOX_GC_GENERATIONAL
+    promoteNursery();
+#endif
+
+    Obj * object = vm->objects;
     while (object != NULL)
     {
         Obj * next = object->next;
         freeObject(object);
         object = next;
     }
-}
\ No newline at end of file
+
+    while (vm->smallStrings != NULL)
+    {
+        Obj * next = vm->smallStrings->next;
+        free(vm->smallStrings);
+        vm->smallStrings = next;
+    }
+
+    free(vm->grayStack);
+
+#ifdef LOX_GC_GENERATIONAL
+    free(vm->remembered);
+#endif
+}
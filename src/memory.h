@@ -4,23 +4,138 @@
 
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-    (type *)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(type, count, category) \
+    (type *)reallocate(NULL, 0, sizeof(type) * (count), category)
 
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0);
+#define FREE(type, pointer, category) \
+    reallocate(pointer, sizeof(type), 0, category);
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(previous, type, oldCount, count) \
-    (type *)reallocate(previous, sizeof(type) * (oldCount), sizeof(type) * (count))
+#define GROW_ARRAY(previous, type, oldCount, count, category) \
+    (type *)reallocate(previous, sizeof(type) * (oldCount), sizeof(type) * (count), category)
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(type, pointer, oldCount, category) \
+    reallocate(pointer, sizeof(type) * (oldCount), 0, category)
 
+#define ARENA_GROW_ARRAY(arena, previous, type, oldCount, count, category) \
+    (type *)arenaReallocate(arena, previous, sizeof(type) * (oldCount), sizeof(type) * (count), category)
 
-void * reallocate(void * previous, size_t oldSize, size_t newSize);
+#define ARENA_FREE_ARRAY(arena, type, pointer, oldCount, category) \
+    arenaReallocate(arena, pointer, sizeof(type) * (oldCount), 0, category)
+
+// The next collection runs once the heap has grown by this factor since the
+// last one. Both can be overridden on the compiler command line.
+#ifndef GC_HEAP_GROW_FACTOR
+#define GC_HEAP_GROW_FACTOR 2
+#endif
+
+#ifndef GC_INITIAL_THRESHOLD
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#endif
+
+// With LOX_GC_GENERATIONAL the nursery is collected whenever this many bytes
+// of objects have been allocated since the last collection.
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+
+// Strings up to this length share one block size and are recycled through a
+// free list instead of going back to the system allocator.
+#define SMALL_STRING_LENGTH 15
+
+// Collection pauses are bucketed by powers of two microseconds, the first
+// bucket holds everything below 1us and the last everything above.
+#define GC_PAUSE_BUCKETS 24
+
+
+// What an allocation is used for, so heap usage can be broken down.
+typedef enum {
+    MEM_OBJECT,
+    MEM_STRING,
+    MEM_CODE,
+    MEM_LINES,
+    MEM_CONSTANTS,
+    MEM_TABLE,
+    MEM_STACK,
+    MEM_CATEGORY_COUNT,
+} MemoryCategory;
+
+typedef struct {
+    size_t bytes;
+    size_t peakBytes;
+    size_t allocations;
+} MemoryCounter;
+
+// Live and peak bytes for everything handed out by reallocate() and
+// arenaReallocate(). Arena backed memory is counted at its requested size,
+// the blocks reserved by arenas are tracked separately in arenaBytes.
+typedef struct {
+    size_t bytesAllocated;
+    size_t peakBytesAllocated;
+    MemoryCounter categories[MEM_CATEGORY_COUNT];
+    MemoryCounter arenaBytes;
+    size_t collections;
+    size_t minorCollections;
+    size_t bytesFreed;
+    uint64_t pauseTotalNs;
+    uint64_t pauseMaxNs;
+    size_t pauseHistogram[GC_PAUSE_BUCKETS];
+} HeapStats;
+
+
+// Every allocation from an arena is rounded up to and aligned on this.
+#define ARENA_ALIGNMENT 16
+
+#define ARENA_HEADER_SIZE (sizeof(void *) + 2 * sizeof(size_t))
+
+typedef struct sArenaBlock {
+    struct sArenaBlock * next;
+    size_t capacity;
+    size_t used;
+    // Pads the header out to a multiple of ARENA_ALIGNMENT, so data is as well
+    // aligned as the block malloc() returned.
+    uint8_t padding[ARENA_ALIGNMENT - ARENA_HEADER_SIZE % ARENA_ALIGNMENT];
+    uint8_t data[];
+} ArenaBlock;
+
+// Bump allocator for memory that all dies at the same time, like the chunk
+// built by interpret(). Individual frees are ignored, everything is released
+// at once by resetArena() or freeArena().
+struct sArena {
+    ArenaBlock * blocks;
+    size_t bytesAllocated;
+    size_t allocations;
+};
+
+
+void * reallocate(void * previous, size_t oldSize, size_t newSize, MemoryCategory category);
+// Same as reallocate() but never starts a collection, for memory that has to
+// grow while something is not rooted yet.
+void * reallocateNoGC(void * previous, size_t oldSize, size_t newSize, MemoryCategory category);
+
+void * allocateStringBlock(int length);
+void freeStringBlock(ObjString * string);
+
+void markObject(Obj * object);
+void markValue(Value value);
+void markArray(ValueArray * array);
+void collectGarbage();
+#ifdef LOX_GC_GENERATIONAL
+void collectNursery();
+// Records an old object that was just made to point at a young one.
+void rememberObject(Obj * object);
+#endif
 void freeObjects();
+void freezeObjects();
+
+void initHeapStats(HeapStats * stats);
+void printHeapStats(HeapStats * stats);
+
+void initArena(Arena * arena);
+void freeArena(Arena * arena);
+void resetArena(Arena * arena);
+void * arenaReallocate(Arena * arena, void * previous, size_t oldSize, size_t newSize, MemoryCategory category);
 
 #endif
@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -8,32 +9,23 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-	(type *)allocateObject(sizeof(type), objectType)
-
-static Obj * allocateObject(size_t size, ObjType type)
+static Obj * initObject(Obj * object, ObjType type)
 {
-	Obj * object = (Obj *)reallocate(NULL, 0, size);
 	object->type = type;
+	object->isMarked = false;
 
-	object->next = vm.objects;
-	vm.objects = object;
+#ifdef LOX_GC_GENERATIONAL
+	object->isOld = false;
+	object->next = vm->youngObjects;
+	vm->youngObjects = object;
+#else
+	object->next = vm->objects;
+	vm->objects = object;
+#endif
 
 	return object;
 }
 
-static ObjString * allocateString(char * chars, int length, uint32_t hash)
-{
-	ObjString * string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-	string->length = length;
-	string->chars = chars;
-	string->hash = hash;
-
-	tableSet(&vm.strings, string, NIL_VAL);
-
-	return string;
-}
-
 static uint32_t hashString(const char * key, int length)
 {
 	uint32_t hash = 2166136261u;
@@ -47,41 +39,256 @@ static uint32_t hashString(const char * key, int length)
 	return hash;
 }
 
-ObjString * takeString(char * chars, int length)
+// A string block that is not yet an object. The caller fills in the
+// characters and hands it to internString().
+static ObjString * newString(int length)
 {
-	uint32_t hash = hashString(chars, length);
-	ObjString * interned = tableFindString(&vm.strings, chars, length, hash);
+	ObjString * string = (ObjString *)allocateStringBlock(length);
+	string->length = length;
+	string->chars[length] = '\0';
+	return string;
+}
+
+static ObjString * findInterned(const char * chars, int length, uint32_t hash)
+{
+	if (vm->sharedStrings != NULL)
+	{
+		ObjString * shared = tableFindString(vm->sharedStrings, chars, length, hash);
+		if (shared != NULL)
+			return shared;
+	}
+
+	return tableFindString(&vm->strings, chars, length, hash);
+}
+
+// Returns the interned copy of string if there is one, freeing string, or
+// turns string into an object and interns it.
+static ObjString * internString(ObjString * string)
+{
+	string->hash = hashString(string->chars, string->length);
 
+	ObjString * interned = findInterned(string->chars, string->length, string->hash);
 	if (interned != NULL)
 	{
-		FREE_ARRAY(char, chars, length);
+		freeStringBlock(string);
 		return interned;
 	}
 
-	return allocateString(chars, length, hash);
+	initObject(&string->obj, OBJ_STRING);
+#ifdef LOX_LAZY_INTERN
+	string->isInterned = true;
+#endif
+
+	// Growing the intern table can trigger a collection, and the table itself
+	// does not keep the string alive.
+	push(OBJ_VAL(string));
+	tableSet(&vm->strings, string, NIL_VAL);
+	pop();
+
+	return string;
 }
 
 ObjString * copyString(const char * chars, int length)
 {
 	uint32_t hash = hashString(chars, length);
-	ObjString * interned = tableFindString(&vm.strings, chars, length, hash);
+	ObjString * interned = findInterned(chars, length, hash);
 
 	if (interned != NULL)
 		return interned;
 
-	char * heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
+	ObjString * string = newString(length);
+	memcpy(string->chars, chars, length);
 
-	return allocateString(heapChars, length, hash);
+	return internString(string);
 }
 
-void printObject(Value value)
+// Turns a string block filled in at runtime into an object. These are the
+// strings that are left uninterned in lazy mode.
+static ObjString * runtimeString(ObjString * string)
+{
+#ifdef LOX_LAZY_INTERN
+	initObject(&string->obj, OBJ_STRING);
+	string->isInterned = false;
+	string->hash = 0;
+	return string;
+#else
+	return internString(string);
+#endif
+}
+
+#ifdef LOX_LAZY_INTERN
+bool stringsEqual(ObjString * a, ObjString * b)
+{
+	if (a == b)
+		return true;
+
+	// Two interned strings are only equal if they are the same object.
+	if (a->isInterned && b->isInterned)
+		return false;
+
+	return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+ObjString * internedString(ObjString * string)
+{
+	if (string->isInterned)
+		return string;
+
+	uint32_t hash = hashString(string->chars, string->length);
+	ObjString * interned = findInterned(string->chars, string->length, hash);
+	if (interned != NULL)
+		return interned;
+
+	string->hash = hash;
+	string->isInterned = true;
+
+	push(OBJ_VAL(string));
+	tableSet(&vm->strings, string, NIL_VAL);
+	pop();
+
+	return string;
+}
+#endif
+
+static int stringLength(Obj * string)
+{
+	if (string->type == OBJ_ROPE)
+		return ((ObjRope *)string)->length;
+
+	return ((ObjString *)string)->length;
+}
+
+// Writes the characters of a string or rope to dest. Nodes are visited right
+// to left and dest is filled from the end, so the usual left leaning ropes
+// built by repeated + only need a couple of pending nodes at a time.
+static void copyChars(Obj * string, char * dest)
+{
+	Obj * initial[32];
+	Obj ** pending = initial;
+	int capacity = 32;
+	int count = 0;
+	char * end = dest + stringLength(string);
+
+	pending[count++] = string;
+	while (count > 0)
+	{
+		Obj * node = pending[--count];
+		ObjString * flat = node->type == OBJ_ROPE ? ((ObjRope *)node)->flat : (ObjString *)node;
+
+		if (flat != NULL)
+		{
+			end -= flat->length;
+			memcpy(end, flat->chars, flat->length);
+			continue;
+		}
+
+		if (count + 2 > capacity)
+		{
+			// The pending list uses the system allocator so copying never starts
+			// a collection.
+			Obj ** grown = (Obj **)malloc(sizeof(Obj *) * capacity * 2);
+			if (grown == NULL)
+				exit(1);
+
+			memcpy(grown, pending, sizeof(Obj *) * count);
+			if (pending != initial)
+				free(pending);
+
+			pending = grown;
+			capacity *= 2;
+		}
+
+		ObjRope * rope = (ObjRope *)node;
+		pending[count++] = rope->left;
+		pending[count++] = rope->right;
+	}
+
+	if (pending != initial)
+		free(pending);
+}
+
+Obj * concatenateRope(Obj * a, Obj * b)
+{
+	int length = stringLength(a) + stringLength(b);
+
+	if (length < ROPE_MIN_LENGTH)
+	{
+		ObjString * string = newString(length);
+		copyChars(a, string->chars);
+		copyChars(b, string->chars + stringLength(a));
+		return (Obj *)runtimeString(string);
+	}
+
+	ObjRope * rope = ALLOCATE(ObjRope, 1, MEM_OBJECT);
+	rope->length = length;
+	rope->left = a;
+	rope->right = b;
+	rope->flat = NULL;
+	return initObject(&rope->obj, OBJ_ROPE);
+}
+
+ObjString * flattenString(Obj * string)
+{
+	if (string->type == OBJ_STRING)
+		return (ObjString *)string;
+
+	ObjRope * rope = (ObjRope *)string;
+	if (rope->flat != NULL)
+		return rope->flat;
+
+	ObjString * flat = newString(rope->length);
+	copyChars(string, flat->chars);
+	flat = runtimeString(flat);
+
+	rope->flat = flat;
+	rope->left = NULL;
+	rope->right = NULL;
+
+#ifdef LOX_GC_GENERATIONAL
+	// The only place an object gains a reference after it is created, so the
+	// only place an old object can start pointing at a young one.
+	if (rope->obj.isOld && !flat->obj.isOld)
+		rememberObject(string);
+#endif
+
+	return flat;
+}
+
+ObjString * concatenateStrings(ObjString * a, ObjString * b)
+{
+	ObjString * string = newString(a->length + b->length);
+	memcpy(string->chars, a->chars, a->length);
+	memcpy(string->chars + a->length, b->chars, b->length);
+
+	return internString(string);
+}
+
+void fprintObject(FILE * out, Value value)
 {
 	switch (OBJ_TYPE(value))
 	{
 		case OBJ_STRING:
-			printf("%s", AS_CSTRING(value));
+			fprintf(out, "%s", AS_CSTRING(value));
+			break;
+
+		case OBJ_ROPE: {
+			// Printing must not allocate from the heap, it happens in places
+			// where a collection would be unsafe.
+			ObjRope * rope = AS_ROPE(value);
+			if (rope->flat != NULL)
+			{
+				fprintf(out, "%s", rope->flat->chars);
+				break;
+			}
+
+			char * chars = (char *)malloc(rope->length);
+			if (chars == NULL)
+				exit(1);
+
+			copyChars(&rope->obj, chars);
+			fwrite(chars, 1, rope->length, out);
+			free(chars);
 			break;
+		}
 	}
 }
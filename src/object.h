@@ -9,31 +9,78 @@
 #define OBJ_TYPE(value)		(AS_OBJ(value)->type)
 
 #define IS_STRING(value)	isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)		isObjType(value, OBJ_ROPE)
+// Either representation of a string.
+#define IS_ANY_STRING(value)	(IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value)	((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value)	(((ObjString *)AS_OBJ(value))->chars)
+#define AS_ROPE(value)		((ObjRope *)AS_OBJ(value))
+
+// Concatenations shorter than this are copied right away instead of building
+// a rope.
+#define ROPE_MIN_LENGTH 64
 
 typedef enum {
 	OBJ_STRING,
+	OBJ_ROPE,
 } ObjType;
 
 struct sObj {
 	ObjType type;
+	bool isMarked;
+#ifdef LOX_GC_GENERATIONAL
+	bool isOld;
+#endif
 	struct sObj * next;
 };
 
+// The characters are stored inline after the header, so a string is a single
+// allocation. Both operands of concatenateStrings() must be reachable by the
+// collector while it runs.
 struct sObjString {
 	Obj obj;
 	int length;
-	char * chars;
+#ifdef LOX_LAZY_INTERN
+	// Runtime strings start out unhashed and outside the intern table.
+	bool isInterned;
+#endif
 	uint32_t hash;
+	char chars[];
 };
 
+#define STRING_SIZE(length)	(sizeof(ObjString) + (length) + 1)
+
+// The lazy result of concatenating two strings or ropes, so chains of + cost
+// time linear in their total length. The characters are only copied out, and
+// the result interned, when something needs the string itself. From then on
+// the rope just forwards to flat and no longer holds on to its operands.
+typedef struct sObjRope {
+	Obj obj;
+	int length;
+	Obj * left;
+	Obj * right;
+	ObjString * flat;
+} ObjRope;
+
 
-ObjString * takeString(char * chars, int length);
 ObjString * copyString(const char * chars, int length);
+ObjString * concatenateStrings(ObjString * a, ObjString * b);
+
+// Concatenates two strings or ropes, returning a rope unless the result is
+// short. Both operands must be reachable by the collector while it runs, and
+// so must string while it is flattened.
+Obj * concatenateRope(Obj * a, Obj * b);
+ObjString * flattenString(Obj * string);
+
+#ifdef LOX_LAZY_INTERN
+bool stringsEqual(ObjString * a, ObjString * b);
+// Returns the interned string with the same characters, hashing and interning
+// string first if there is none. For anything that needs a table key.
+ObjString * internedString(ObjString * string);
+#endif
 
-void printObject(Value value);
+void fprintObject(FILE * out, Value value);
 
 static inline bool isObjType(Value value, ObjType type)
 {
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(LOX_PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "cache.h"
+#include "compiler.h"
+#ifdef LOX_JIT
+#include "jit.h"
+#endif
+#include "memory.h"
+#include "pool.h"
+#include "trace.h"
+
+#if defined(LOX_PLATFORM_WINDOWS)
+typedef CRITICAL_SECTION Mutex;
+#define initMutex(mutex) InitializeCriticalSection(mutex)
+#define freeMutex(mutex) DeleteCriticalSection(mutex)
+#define lockMutex(mutex) EnterCriticalSection(mutex)
+#define unlockMutex(mutex) LeaveCriticalSection(mutex)
+#else
+typedef pthread_mutex_t Mutex;
+#define initMutex(mutex) pthread_mutex_init(mutex, NULL)
+#define freeMutex(mutex) pthread_mutex_destroy(mutex)
+#define lockMutex(mutex) pthread_mutex_lock(mutex)
+#define unlockMutex(mutex) pthread_mutex_unlock(mutex)
+#endif
+
+struct sSharedScript {
+	SharedScript * next;
+	uint64_t hash;
+	char * source;
+	// One reference for every acquireScript() not released yet. The last
+	// release takes the script out of the pool and frees it.
+	int refCount;
+
+	// The VM the script was compiled in. Its heap holds the chunk and the
+	// constant strings, and its string table is the frozen shared table.
+	VM * owner;
+	Chunk chunk;
+};
+
+struct sScriptPool {
+	Mutex lock;
+	SharedScript * scripts;
+	bool foldConstants;
+};
+
+
+ScriptPool * newScriptPool(bool foldConstants)
+{
+	ScriptPool * pool = (ScriptPool *)malloc(sizeof(ScriptPool));
+	if (pool == NULL)
+		return NULL;
+
+	initMutex(&pool->lock);
+	pool->scripts = NULL;
+	pool->foldConstants = foldConstants;
+	return pool;
+}
+
+static void freeScript(SharedScript * script)
+{
+	VM * previous = bindVM(script->owner);
+	freeChunk(&script->chunk);
+	bindVM(previous);
+
+	freeVM(script->owner);
+	free(script->source);
+	free(script);
+}
+
+static SharedScript * compileScript(const char * source, uint64_t hash, bool foldConstants)
+{
+	SharedScript * script = (SharedScript *)malloc(sizeof(SharedScript));
+	if (script == NULL)
+		return NULL;
+
+	size_t length = strlen(source);
+	script->next = NULL;
+	script->hash = hash;
+	script->source = (char *)malloc(length + 1);
+	script->refCount = 0;
+	script->owner = newVM();
+	initChunk(&script->chunk);
+
+	if (script->source == NULL || script->owner == NULL)
+	{
+		free(script->source);
+		if (script->owner != NULL)
+			freeVM(script->owner);
+		free(script);
+		return NULL;
+	}
+
+	memcpy(script->source, source, length + 1);
+	script->owner->foldConstants = foldConstants;
+
+	VM * previous = bindVM(script->owner);
+	bool compiled = compile(source, &script->chunk);
+	if (compiled)
+		freezeObjects();
+#ifdef LOX_JIT
+	// Every script in the pool is expected to run many times.
+	if (compiled && compileNative(&script->chunk))
+		TRACE(TRACE_FLAG_JIT, "Compiled to native code for the pool\n");
+#endif
+	script->chunk.readOnly = true;
+	bindVM(previous);
+
+	if (!compiled)
+	{
+		freeScript(script);
+		return NULL;
+	}
+
+	return script;
+}
+
+SharedScript * acquireScript(ScriptPool * pool, const char * source)
+{
+	uint64_t hash = hashSource(source);
+
+	// Compiling under the lock keeps two threads from compiling the same
+	// script at once. Scripts are compiled once, so the wait is short lived.
+	lockMutex(&pool->lock);
+
+	SharedScript * script = pool->scripts;
+	while (script != NULL && (script->hash != hash || strcmp(script->source, source) != 0))
+		script = script->next;
+
+	if (script == NULL)
+	{
+		script = compileScript(source, hash, pool->foldConstants);
+		if (script != NULL)
+		{
+			script->next = pool->scripts;
+			pool->scripts = script;
+		}
+	}
+
+	if (script != NULL)
+		script->refCount++;
+
+	unlockMutex(&pool->lock);
+	return script;
+}
+
+void releaseScript(ScriptPool * pool, SharedScript * script)
+{
+	lockMutex(&pool->lock);
+
+	bool unused = --script->refCount == 0;
+	if (unused)
+	{
+		SharedScript ** link = &pool->scripts;
+		while (*link != script)
+			link = &(*link)->next;
+		*link = script->next;
+	}
+
+	unlockMutex(&pool->lock);
+
+	// Nobody can find the script any more, so it is freed outside the lock.
+	if (unused)
+		freeScript(script);
+}
+
+void freeScriptPool(ScriptPool * pool)
+{
+	// Only scripts that were never released are left.
+	SharedScript * script = pool->scripts;
+	while (script != NULL)
+	{
+		SharedScript * next = script->next;
+		freeScript(script);
+		script = next;
+	}
+
+	freeMutex(&pool->lock);
+	free(pool);
+}
+
+InterpretResult interpretSharedIn(VM * instance, SharedScript * script)
+{
+	VM * previous = bindVM(instance);
+
+	vm->sharedStrings = &script->owner->strings;
+	InterpretResult result = runChunk(&script->chunk);
+	vm->sharedStrings = NULL;
+
+	bindVM(previous);
+	return result;
+}
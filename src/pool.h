@@ -0,0 +1,27 @@
+#ifndef LOX_POOL_H
+#define LOX_POOL_H
+
+#include "vm.h"
+
+
+// A pool of compiled scripts that any number of VMs can run at the same time.
+// Each script is compiled once, keyed by its source, and then never changes:
+// its chunk and its constant strings live in a frozen heap of their own.
+typedef struct sScriptPool ScriptPool;
+typedef struct sSharedScript SharedScript;
+
+
+// Scripts are compiled with constant folding when foldConstants is set.
+ScriptPool * newScriptPool(bool foldConstants);
+// Every script acquired from the pool has to be released first.
+void freeScriptPool(ScriptPool * pool);
+
+// Returns the compiled script for source, compiling it on first use, or NULL
+// when it does not compile. Every acquired script must be released, and the
+// last release takes it out of the pool and frees it.
+SharedScript * acquireScript(ScriptPool * pool, const char * source);
+void releaseScript(ScriptPool * pool, SharedScript * script);
+
+InterpretResult interpretSharedIn(VM * instance, SharedScript * script);
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profile.h"
+#include "timer.h"
+
+// How many entries the pair and line sections of the report show.
+#define PROFILE_TOP 20
+
+static const char * opcodeNames[OP_COUNT] = {
+#define OPCODE_NAME(name, length, stackEffect) #name,
+	OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+
+uint64_t profileClock()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return timerNanoseconds();
+#endif
+}
+
+void initProfile(Profile * profile)
+{
+	memset(profile, 0, sizeof(Profile));
+	profile->lastOp = -1;
+}
+
+void freeProfile(Profile * profile)
+{
+	free(profile->offsetCounts);
+	free(profile->offsetCycles);
+	free(profile->lineCounts);
+	free(profile->lineCycles);
+	initProfile(profile);
+}
+
+// The profile uses the system allocator so it never shows up in the heap
+// statistics or moves the collector's thresholds.
+static uint64_t * growCounters(uint64_t * counters, int oldCapacity, int capacity)
+{
+	counters = (uint64_t *)realloc(counters, sizeof(uint64_t) * capacity);
+	if (counters == NULL)
+		exit(1);
+
+	memset(counters + oldCapacity, 0, sizeof(uint64_t) * (capacity - oldCapacity));
+	return counters;
+}
+
+void beginProfileRun(Profile * profile, Chunk * chunk)
+{
+	if (profile->offsetCapacity < chunk->count)
+	{
+		profile->offsetCounts = growCounters(profile->offsetCounts, profile->offsetCapacity, chunk->count);
+		profile->offsetCycles = growCounters(profile->offsetCycles, profile->offsetCapacity, chunk->count);
+		profile->offsetCapacity = chunk->count;
+	}
+
+	memset(profile->offsetCounts, 0, sizeof(uint64_t) * chunk->count);
+	memset(profile->offsetCycles, 0, sizeof(uint64_t) * chunk->count);
+	profile->lastOp = -1;
+}
+
+void endProfileRun(Profile * profile, Chunk * chunk)
+{
+	if (profile->lastOp >= 0)
+	{
+		uint64_t elapsed = profileClock() - profile->lastClock;
+		profile->cycles[profile->lastOp] += elapsed;
+		profile->offsetCycles[profile->lastOffset] += elapsed;
+		profile->lastOp = -1;
+	}
+
+	for (int offset = 0; offset < chunk->count; offset++)
+	{
+		if (profile->offsetCounts[offset] == 0)
+			continue;
+
+		int line = getLine(chunk, offset);
+		if (line < 0)
+			continue;
+
+		if (profile->lineCapacity <= line)
+		{
+			int capacity = profile->lineCapacity;
+			while (capacity <= line)
+				capacity = GROW_CAPACITY(capacity);
+
+			profile->lineCounts = growCounters(profile->lineCounts, profile->lineCapacity, capacity);
+			profile->lineCycles = growCounters(profile->lineCycles, profile->lineCapacity, capacity);
+			profile->lineCapacity = capacity;
+		}
+
+		profile->lineCounts[line] += profile->offsetCounts[offset];
+		profile->lineCycles[line] += profile->offsetCycles[offset];
+	}
+}
+
+typedef struct {
+	int index;
+	uint64_t key;
+} Ranked;
+
+static int compareRanked(const void * a, const void * b)
+{
+	uint64_t x = ((const Ranked *)a)->key;
+	uint64_t y = ((const Ranked *)b)->key;
+	return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// Fills ranked with the non-zero entries of keys, largest first, and returns
+// how many there are.
+static int rank(Ranked * ranked, const uint64_t * keys, int count)
+{
+	int used = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (keys[i] == 0)
+			continue;
+
+		ranked[used].index = i;
+		ranked[used].key = keys[i];
+		used++;
+	}
+
+	qsort(ranked, used, sizeof(Ranked), compareRanked);
+	return used;
+}
+
+void printProfile(Profile * profile, FILE * out)
+{
+	uint64_t total = 0;
+	uint64_t totalCycles = 0;
+	for (int i = 0; i < OP_COUNT; i++)
+	{
+		total += profile->counts[i];
+		totalCycles += profile->cycles[i];
+	}
+
+	if (total == 0)
+		return;
+
+	Ranked ops[OP_COUNT];
+	int used = rank(ops, profile->cycles, OP_COUNT);
+
+	fprintf(out, "== profile ==\n");
+	fprintf(out, "  %-20s %14s %6s %16s %6s %10s\n", "opcode", "count", "%", "cycles", "%", "cycles/op");
+	for (int i = 0; i < used; i++)
+	{
+		int op = ops[i].index;
+		fprintf(out, "  %-20s %14llu %5.1f%% %16llu %5.1f%% %10.1f\n", opcodeNames[op],
+			(unsigned long long)profile->counts[op], 100.0 * profile->counts[op] / total,
+			(unsigned long long)profile->cycles[op], totalCycles ? 100.0 * profile->cycles[op] / totalCycles : 0.0,
+			(double)profile->cycles[op] / profile->counts[op]);
+	}
+
+	Ranked * pairs = (Ranked *)malloc(sizeof(Ranked) * OP_COUNT * OP_COUNT);
+	if (pairs != NULL)
+	{
+		used = rank(pairs, &profile->pairs[0][0], OP_COUNT * OP_COUNT);
+
+		fprintf(out, "== opcode pairs ==\n");
+		for (int i = 0; i < used && i < PROFILE_TOP; i++)
+		{
+			int first = pairs[i].index / OP_COUNT;
+			int second = pairs[i].index % OP_COUNT;
+			fprintf(out, "  %-20s %-20s %14llu\n", opcodeNames[first], opcodeNames[second], (unsigned long long)pairs[i].key);
+		}
+
+		free(pairs);
+	}
+
+	Ranked * lines = (Ranked *)malloc(sizeof(Ranked) * (profile->lineCapacity + 1));
+	if (lines != NULL)
+	{
+		used = rank(lines, profile->lineCycles, profile->lineCapacity);
+
+		fprintf(out, "== lines ==\n");
+		fprintf(out, "  %-8s %14s %16s %6s\n", "line", "count", "cycles", "%");
+		for (int i = 0; i < used && i < PROFILE_TOP; i++)
+		{
+			int line = lines[i].index;
+			fprintf(out, "  %-8d %14llu %16llu %5.1f%%\n", line,
+				(unsigned long long)profile->lineCounts[line], (unsigned long long)profile->lineCycles[line],
+				totalCycles ? 100.0 * profile->lineCycles[line] / totalCycles : 0.0);
+		}
+
+		free(lines);
+	}
+}
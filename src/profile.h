@@ -0,0 +1,67 @@
+#ifndef LOX_PROFILE_H
+#define LOX_PROFILE_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+
+// Per-opcode execution counts and cycles, opcode pair frequencies and per-line
+// totals, gathered by run() in builds with LOX_PROFILE defined. Cycles come
+// from the time stamp counter on x86 and are nanoseconds everywhere else.
+typedef struct {
+	uint64_t counts[OP_COUNT];
+	uint64_t cycles[OP_COUNT];
+	uint64_t pairs[OP_COUNT][OP_COUNT];
+
+	// The instruction being timed, -1 between runs.
+	int lastOp;
+	int lastOffset;
+	uint64_t lastClock;
+
+	// Totals for each code offset of the chunk being run, folded into the
+	// per-line totals when the run ends.
+	int offsetCapacity;
+	uint64_t * offsetCounts;
+	uint64_t * offsetCycles;
+
+	int lineCapacity;
+	uint64_t * lineCounts;
+	uint64_t * lineCycles;
+} Profile;
+
+
+uint64_t profileClock();
+
+void initProfile(Profile * profile);
+void freeProfile(Profile * profile);
+
+void beginProfileRun(Profile * profile, Chunk * chunk);
+void endProfileRun(Profile * profile, Chunk * chunk);
+
+// Charges the time since the previous instruction to it and starts timing the
+// instruction at offset.
+static inline void profileInstruction(Profile * profile, Chunk * chunk, int offset)
+{
+	uint64_t now = profileClock();
+	int op = chunk->code[offset];
+
+	if (profile->lastOp >= 0)
+	{
+		uint64_t elapsed = now - profile->lastClock;
+		profile->cycles[profile->lastOp] += elapsed;
+		profile->offsetCycles[profile->lastOffset] += elapsed;
+		profile->pairs[profile->lastOp][op]++;
+	}
+
+	profile->counts[op]++;
+	profile->offsetCounts[offset]++;
+
+	profile->lastOp = op;
+	profile->lastOffset = offset;
+	profile->lastClock = now;
+}
+
+void printProfile(Profile * profile, FILE * out);
+
+#endif
@@ -5,14 +5,219 @@
 #include "common.h"
 #include "scanner.h"
 
+#if defined(LOX_SIMD_SSE2)
+#include <emmintrin.h>
+#elif defined(LOX_SIMD_NEON)
+#include <arm_neon.h>
+#endif
+
 
 void initScanner(Scanner * scanner, const char * source)
 {
     scanner->start = source;
     scanner->current = source;
+    scanner->end = source + strlen(source);
     scanner->line = 0;
 }
 
+#if defined(LOX_SIMD_SSE2) || defined(LOX_SIMD_NEON)
+#define SCANNER_SIMD
+
+// The block helpers below compare 16 source bytes at a time and reduce the
+// result to an integer mask. SSE2 gives one bit per byte, NEON four, so
+// positions and counts are divided by LANE_BITS.
+#define BLOCK_SIZE 16
+
+#if defined(LOX_SIMD_SSE2)
+
+typedef __m128i Block;
+
+#define LANE_BITS 1
+#define ALL_LANES ((uint64_t)0xffff)
+
+static inline Block loadBlock(const char * p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline Block equalTo(Block block, char c) { return _mm_cmpeq_epi8(block, _mm_set1_epi8(c)); }
+static inline Block either(Block a, Block b) { return _mm_or_si128(a, b); }
+
+static inline Block inRange(Block block, char low, char high)
+{
+    // Unsigned (block - low) <= (high - low), built from min since SSE2 has no
+    // unsigned byte compare.
+    __m128i offset = _mm_sub_epi8(block, _mm_set1_epi8(low));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(high - low)), offset);
+}
+
+static inline uint64_t blockMask(Block block) { return (uint64_t)(uint32_t)_mm_movemask_epi8(block); }
+
+#else
+
+typedef uint8x16_t Block;
+
+#define LANE_BITS 4
+#define ALL_LANES (~(uint64_t)0)
+
+static inline Block loadBlock(const char * p) { return vld1q_u8((const uint8_t *)p); }
+static inline Block equalTo(Block block, char c) { return vceqq_u8(block, vdupq_n_u8((uint8_t)c)); }
+static inline Block either(Block a, Block b) { return vorrq_u8(a, b); }
+
+static inline Block inRange(Block block, char low, char high)
+{
+    return vcleq_u8(vsubq_u8(block, vdupq_n_u8((uint8_t)low)), vdupq_n_u8((uint8_t)(high - low)));
+}
+
+static inline uint64_t blockMask(Block block)
+{
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(block), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+
+#endif
+
+static inline int firstLane(uint64_t mask)
+{
+    return __builtin_ctzll(mask) / LANE_BITS;
+}
+
+static inline int countLanes(uint64_t mask)
+{
+    return __builtin_popcountll(mask) / LANE_BITS;
+}
+
+static inline uint64_t lanesBelow(int lane)
+{
+    return lane * LANE_BITS >= 64 ? ALL_LANES : (((uint64_t)1 << (lane * LANE_BITS)) - 1);
+}
+
+#endif
+
+// Skips spaces, tabs, carriage returns and newlines, counting the newlines.
+static void skipBlanks(Scanner * scanner)
+{
+    const char * p = scanner->current;
+
+#ifdef SCANNER_SIMD
+    while (scanner->end - p >= BLOCK_SIZE)
+    {
+        Block block = loadBlock(p);
+        uint64_t newlines = blockMask(equalTo(block, '\n'));
+        uint64_t blanks = blockMask(either(either(equalTo(block, ' '), equalTo(block, '\t')),
+                                           either(equalTo(block, '\r'), equalTo(block, '\n'))));
+        uint64_t other = ~blanks & ALL_LANES;
+
+        if (other == 0)
+        {
+            scanner->line += countLanes(newlines);
+            p += BLOCK_SIZE;
+            continue;
+        }
+
+        int lane = firstLane(other);
+        scanner->line += countLanes(newlines & lanesBelow(lane));
+        scanner->current = p + lane;
+        return;
+    }
+#endif
+
+    for (; *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'; p++)
+    {
+        if (*p == '\n')
+            scanner->line++;
+    }
+
+    scanner->current = p;
+}
+
+// Skips to the newline ending a line comment, or to the end of the source.
+static void skipLine(Scanner * scanner)
+{
+    const char * p = scanner->current;
+
+#ifdef SCANNER_SIMD
+    while (scanner->end - p >= BLOCK_SIZE)
+    {
+        uint64_t newlines = blockMask(equalTo(loadBlock(p), '\n'));
+        if (newlines != 0)
+        {
+            scanner->current = p + firstLane(newlines);
+            return;
+        }
+
+        p += BLOCK_SIZE;
+    }
+#endif
+
+    while (*p != '\n' && *p != '\0')
+        p++;
+
+    scanner->current = p;
+}
+
+// Skips the rest of an identifier or keyword.
+static void skipIdentifier(Scanner * scanner)
+{
+    const char * p = scanner->current;
+
+#ifdef SCANNER_SIMD
+    while (scanner->end - p >= BLOCK_SIZE)
+    {
+        Block block = loadBlock(p);
+        uint64_t word = blockMask(either(either(inRange(block, 'a', 'z'), inRange(block, 'A', 'Z')),
+                                         either(inRange(block, '0', '9'), equalTo(block, '_'))));
+        uint64_t other = ~word & ALL_LANES;
+
+        if (other != 0)
+        {
+            scanner->current = p + firstLane(other);
+            return;
+        }
+
+        p += BLOCK_SIZE;
+    }
+#endif
+
+    while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+           (*p >= '0' && *p <= '9') || *p == '_')
+        p++;
+
+    scanner->current = p;
+}
+
+// Skips to the closing quote of a string literal, or to the end of the source,
+// counting the newlines inside the literal.
+static void skipStringBody(Scanner * scanner)
+{
+    const char * p = scanner->current;
+
+#ifdef SCANNER_SIMD
+    while (scanner->end - p >= BLOCK_SIZE)
+    {
+        Block block = loadBlock(p);
+        uint64_t newlines = blockMask(equalTo(block, '\n'));
+        uint64_t quotes = blockMask(equalTo(block, '"'));
+
+        if (quotes == 0)
+        {
+            scanner->line += countLanes(newlines);
+            p += BLOCK_SIZE;
+            continue;
+        }
+
+        int lane = firstLane(quotes);
+        scanner->line += countLanes(newlines & lanesBelow(lane));
+        scanner->current = p + lane;
+        return;
+    }
+#endif
+
+    for (; *p != '"' && *p != '\0'; p++)
+    {
+        if (*p == '\n')
+            scanner->line++;
+    }
+
+    scanner->current = p;
+}
+
 static bool isAlpha(char c)
 {
     return (c >= 'a' && c <= 'z') ||
@@ -92,19 +297,14 @@ static void skipWhitespace(Scanner * scanner)
             case ' ':
             case '\r':
             case '\t':
-                advance(scanner);
-                break;
-
             case '\n':
-                scanner->line++;
-                advance(scanner);
+                skipBlanks(scanner);
                 break;
 
             case '/':
                 if (peakNext(scanner) == '/')
                 {
-                    while (peak(scanner) != '\n' && !isAtEnd(scanner))
-                        advance(scanner);
+                    skipLine(scanner);
                 }
                 else
                 {
@@ -118,60 +318,59 @@ static void skipWhitespace(Scanner * scanner)
     }
 }
 
-static TokenType checkKeyword(Scanner * scanner, int start, int length, const char * rest, TokenType token)
-{
-    if (scanner->current - scanner->start == start + length &&
-        memcmp(scanner->start + start, rest, length) == 0)
-        return token;
-    return TOKEN_IDENTIFIER;
-}
+typedef struct {
+    const char * name;
+    int length;
+    TokenType type;
+} Keyword;
+
+// Perfect hash over the keyword set: no two keywords share a slot, so an
+// identifier is classified with one table lookup and at most one memcmp.
+// Slots were found by searching for multipliers that leave the 16 keywords
+// collision free in 32 slots; keep KEYWORD_HASH and the table in sync when
+// adding a keyword.
+#define KEYWORD_SLOTS       32
+#define KEYWORD_MIN_LENGTH  2
+#define KEYWORD_MAX_LENGTH  6
+
+#define KEYWORD_HASH(start, length) \
+    (((unsigned char)(start)[0] + (unsigned char)(start)[(length) - 1] * 5 + (length)) & (KEYWORD_SLOTS - 1))
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    [ 2] = { "else", 4, TOKEN_ELSE },
+    [ 3] = { "for", 3, TOKEN_FOR },
+    [ 4] = { "false", 5, TOKEN_FALSE },
+    [ 7] = { "class", 5, TOKEN_CLASS },
+    [ 9] = { "if", 2, TOKEN_IF },
+    [11] = { "or", 2, TOKEN_OR },
+    [13] = { "nil", 3, TOKEN_NIL },
+    [15] = { "fun", 3, TOKEN_FUN },
+    [17] = { "true", 4, TOKEN_TRUE },
+    [18] = { "super", 5, TOKEN_SUPER },
+    [19] = { "var", 3, TOKEN_VAR },
+    [21] = { "while", 5, TOKEN_WHILE },
+    [23] = { "this", 4, TOKEN_THIS },
+    [24] = { "and", 3, TOKEN_AND },
+    [25] = { "print", 5, TOKEN_PRINT },
+    [30] = { "return", 6, TOKEN_RETURN },
+};
 
 static TokenType identifierType(Scanner * scanner)
 {
-    switch (scanner->start[0])
-    {
-        case 'a': return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner->current - scanner->start > 1)
-            {
-                switch (scanner->start[1])
-                {
-                    case 'a': return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 'i': return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner->current - scanner->start > 1)
-            {
-                switch (scanner->start[1])
-                {
-                    case 'h': return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-        case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
-    }
+    int length = (int)(scanner->current - scanner->start);
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH)
+        return TOKEN_IDENTIFIER;
 
+    const Keyword * keyword = &keywords[KEYWORD_HASH(scanner->start, length)];
+    if (keyword->length == length && memcmp(scanner->start, keyword->name, length) == 0)
+        return keyword->type;
 
     return TOKEN_IDENTIFIER;
 }
 
 static Token identifier(Scanner * scanner)
 {
-    while (isAlpha(peak(scanner)) || isDigit(peak(scanner)))
-        advance(scanner);
+    skipIdentifier(scanner);
 
     return makeToken(scanner, identifierType(scanner));
 }
@@ -193,12 +392,7 @@ static Token number(Scanner * scanner)
 
 static Token string(Scanner * scanner)
 {
-    while (peak(scanner) != '"' && !isAtEnd(scanner))
-    {
-        if (peak(scanner) == '\n')
-            scanner->line++;
-        advance(scanner);
-    }
+    skipStringBody(scanner);
 
     if (isAtEnd(scanner))
         return errorToken(scanner, "Unterminated string.");
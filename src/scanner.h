@@ -39,6 +39,7 @@ typedef struct {
 typedef struct {
     const char * start;
     const char * current;
+    const char * end;
     int line;
 } Scanner;
 
@@ -7,110 +7,268 @@
 #include "value.h"
 #include "table.h"
 
+#if defined(LOX_SIMD_SSE2)
+#include <emmintrin.h>
+#elif defined(LOX_SIMD_NEON)
+#include <arm_neon.h>
+#endif
+
 
 #define TABLE_MAX_LOAD	0.75
 
+// Slots are probed a group at a time. Groups are aligned, and probing moves
+// from group to group in triangular steps, which visits every group of a
+// power of two count before repeating one.
+#define GROUP_SIZE		16
+
+// The control byte of a full slot is the top 7 bits of its key's hash, so the
+// high bit alone tells full slots from the others.
+#define CONTROL_EMPTY	0x80
+#define CONTROL_DELETED	0xfe
+
+#define FINGERPRINT(hash)	((uint8_t)((hash) >> 25))
+#define IS_FULL(control)	((control) < 0x80)
+
+// The match helpers compare the control bytes of one group and reduce the
+// result to a mask with a set bit for each matching slot. NEON sets the top
+// bit of four per slot, so slots are found by dividing by LANE_BITS.
+#if defined(LOX_SIMD_SSE2)
+
+#define LANE_BITS 1
+
+static inline uint64_t matchByte(const uint8_t * group, uint8_t byte)
+{
+	__m128i block = _mm_loadu_si128((const __m128i *)group);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8((char)byte)));
+}
+
+static inline uint64_t matchFree(const uint8_t * group)
+{
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+
+#elif defined(LOX_SIMD_NEON)
+
+#define LANE_BITS 4
+
+static inline uint64_t laneMask(uint8x16_t block)
+{
+	uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(block), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) & 0x8888888888888888u;
+}
+
+static inline uint64_t matchByte(const uint8_t * group, uint8_t byte)
+{
+	return laneMask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)));
+}
+
+static inline uint64_t matchFree(const uint8_t * group)
+{
+	return laneMask(vtstq_u8(vld1q_u8(group), vdupq_n_u8(0x80)));
+}
+
+#else
+
+#define LANE_BITS 1
+
+static inline uint64_t matchByte(const uint8_t * group, uint8_t byte)
+{
+	uint64_t mask = 0;
+	for (int i = 0; i < GROUP_SIZE; i++)
+		mask |= (uint64_t)(group[i] == byte) << i;
+	return mask;
+}
+
+static inline uint64_t matchFree(const uint8_t * group)
+{
+	uint64_t mask = 0;
+	for (int i = 0; i < GROUP_SIZE; i++)
+		mask |= (uint64_t)!IS_FULL(group[i]) << i;
+	return mask;
+}
+
+#endif
+
+static inline int firstLane(uint64_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(mask) / LANE_BITS;
+#else
+	int bit = 0;
+	while ((mask & 1) == 0)
+	{
+		mask >>= 1;
+		bit++;
+	}
+	return bit / LANE_BITS;
+#endif
+}
+
+// The control bytes come first in a single block, followed by the keys and
+// then the values.
+static size_t tableBytes(int capacity)
+{
+	return (size_t)capacity * (1 + sizeof(ObjString *) + sizeof(Value));
+}
+
 void initTable(Table * table)
 {
 	table->count = 0;
+	table->tombstones = 0;
 	table->capacity = 0;
-	table->entries = NULL;
+	table->control = NULL;
+	table->keys = NULL;
+	table->values = NULL;
 }
 
 void freeTable(Table * table)
 {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(uint8_t, table->control, tableBytes(table->capacity), MEM_TABLE);
 	initTable(table);
 }
 
-static Entry * findEntry(Entry * entries, int capacity, ObjString * key)
+// Returns the slot holding key, or -1 when it is not in the table.
+static int findSlot(Table * table, ObjString * key)
 {
-	uint32_t index = key->hash % capacity;
-	Entry * tombstone = NULL;
+	uint32_t groupMask = (uint32_t)(table->capacity / GROUP_SIZE) - 1;
+	uint32_t group = key->hash & groupMask;
+	uint8_t fingerprint = FINGERPRINT(key->hash);
 
-	for (;;)
+	for (uint32_t step = 1;; step++)
 	{
-		Entry * entry = &entries[index];
+		const uint8_t * control = &table->control[group * GROUP_SIZE];
 
-		if (entry->key == NULL)
+		for (uint64_t match = matchByte(control, fingerprint); match != 0; match &= match - 1)
 		{
-			if (IS_NIL(entry->value))
-			{
-				return tombstone != NULL ? tombstone : entry;
-			}
-			else
-			{
-				if (tombstone == NULL)
-					tombstone = entry;
-			}
-		}
-		else if (entry->key == key)
-		{
-			return entry;
+			int slot = (int)(group * GROUP_SIZE) + firstLane(match);
+			if (table->keys[slot] == key)
+				return slot;
 		}
 
-		index = (index + 1) % capacity;
+		// The key would have gone into this group's empty slot.
+		if (matchByte(control, CONTROL_EMPTY) != 0)
+			return -1;
+
+		group = (group + step) & groupMask;
 	}
 }
 
-static void adjustCapacity(Table * table, int capacity)
+// Returns the first empty or deleted slot on the probe path of hash.
+static int findFreeSlot(const uint8_t * control, int capacity, uint32_t hash)
 {
-	Entry * entries = ALLOCATE(Entry, capacity);
+	uint32_t groupMask = (uint32_t)(capacity / GROUP_SIZE) - 1;
+	uint32_t group = hash & groupMask;
 
-	for (int i = 0; i < capacity; i++)
+	for (uint32_t step = 1;; step++)
 	{
-		entries[i].key = NULL;
-		entries[i].value = NIL_VAL;
+		uint64_t match = matchFree(&control[group * GROUP_SIZE]);
+		if (match != 0)
+			return (int)(group * GROUP_SIZE) + firstLane(match);
+
+		group = (group + step) & groupMask;
 	}
+}
+
+static void adjustCapacity(Table * table, int capacity)
+{
+	uint8_t * block = ALLOCATE(uint8_t, tableBytes(capacity), MEM_TABLE);
+	uint8_t * control = block;
+	ObjString ** keys = (ObjString **)(block + capacity);
+	Value * values = (Value *)(keys + capacity);
+
+	memset(control, CONTROL_EMPTY, (size_t)capacity);
 
 	table->count = 0;
+	table->tombstones = 0;
 	for (int i = 0; i < table->capacity; i++)
 	{
-		Entry * entry = &table->entries[i];
-		if (entry->key == NULL)
+		if (!IS_FULL(table->control[i]))
 			continue;
 
-		Entry * dest = findEntry(entries, capacity, entry->key);
-		dest->key = entry->key;
-		dest->value = entry->value;
+		ObjString * key = table->keys[i];
+		int slot = findFreeSlot(control, capacity, key->hash);
+		control[slot] = table->control[i];
+		keys[slot] = key;
+		values[slot] = table->values[i];
 		table->count++;
 	}
 
-	FREE_ARRAY(Entry, table->entries, table->capacity);
-	table->entries = entries;
+	FREE_ARRAY(uint8_t, table->control, tableBytes(table->capacity), MEM_TABLE);
+	table->control = control;
+	table->keys = keys;
+	table->values = values;
 	table->capacity = capacity;
 }
 
+void tableReserve(Table * table, int count)
+{
+	if (count <= table->capacity * TABLE_MAX_LOAD)
+		return;
+
+	// Only the live entries decide the size. When they fit, rebuilding at the
+	// same capacity clears the tombstones, so tables that see many deletes
+	// like the intern table do not keep doubling.
+	int capacity = table->capacity;
+	while (count - table->tombstones > capacity * TABLE_MAX_LOAD)
+		capacity = capacity < GROUP_SIZE ? GROUP_SIZE : capacity * 2;
+
+	adjustCapacity(table, capacity);
+}
+
 bool tableGet(Table * table, ObjString * key, Value * value)
 {
-	if (table->entries == NULL)
+	if (table->count == 0)
 		return false;
 
-	Entry * entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL)
+	int slot = findSlot(table, key);
+	if (slot < 0)
 		return false;
 
-	*value = entry->value;
+	*value = table->values[slot];
 	return true;
 }
 
 bool tableSet(Table * table, ObjString * key, Value value)
 {
-	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+	tableReserve(table, table->count + 1);
+
+	int slot = findSlot(table, key);
+	if (slot >= 0)
 	{
-		int capacity = GROW_CAPACITY(table->capacity);
-		adjustCapacity(table, capacity);
+		table->values[slot] = value;
+		return false;
 	}
 
-	Entry * entry = findEntry(table->entries, table->capacity, key);
-	bool isNewKey = entry->key == NULL;
-	entry->key = key;
-	entry->value = value;
-
-	if (isNewKey)
+	// Reusing a tombstone leaves the load as it was.
+	slot = findFreeSlot(table->control, table->capacity, key->hash);
+	if (table->control[slot] == CONTROL_EMPTY)
 		table->count++;
+	else
+		table->tombstones--;
+
+	table->control[slot] = FINGERPRINT(key->hash);
+	table->keys[slot] = key;
+	table->values[slot] = value;
+	return true;
+}
 
-	return isNewKey;
+// A slot whose group still has an empty slot can become empty again, probes
+// for any key that went past it stop in that group anyway. Otherwise it has to
+// stay a tombstone so those probes carry on.
+static void deleteSlot(Table * table, int slot)
+{
+	const uint8_t * group = &table->control[slot - slot % GROUP_SIZE];
+
+	if (matchByte(group, CONTROL_EMPTY) != 0)
+	{
+		table->control[slot] = CONTROL_EMPTY;
+		table->count--;
+	}
+	else
+	{
+		table->control[slot] = CONTROL_DELETED;
+		table->tombstones++;
+	}
 }
 
 bool tableDelete(Table * table, ObjString * key)
@@ -118,43 +276,58 @@ bool tableDelete(Table * table, ObjString * key)
 	if (table->count == 0)
 		return false;
 
-	Entry * entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL)
+	int slot = findSlot(table, key);
+	if (slot < 0)
 		return false;
 
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
-
+	deleteSlot(table, slot);
 	return true;
 }
 
 void tableAddAll(Table * from, Table * to)
 {
+	tableReserve(to, to->count + from->count);
+
 	for (int i = 0; i < from->capacity; i++)
 	{
-		Entry *  entry = &from->entries[i];
-		if (entry->key != NULL)
-			tableSet(to, entry->key, entry->value);
+		if (IS_FULL(from->control[i]))
+			tableSet(to, from->keys[i], from->values[i]);
+	}
+}
+
+void tableRemoveWhite(Table * table)
+{
+	for (int i = 0; i < table->capacity; i++)
+	{
+		if (IS_FULL(table->control[i]) && !table->keys[i]->obj.isMarked)
+			deleteSlot(table, i);
 	}
 }
 
 ObjString * tableFindString(Table * table, const char * chars, int length, uint32_t hash)
 {
-	if (table->entries == NULL)
+	if (table->count == 0)
 		return NULL;
 
-	uint32_t index = hash & table->capacity;
+	uint32_t groupMask = (uint32_t)(table->capacity / GROUP_SIZE) - 1;
+	uint32_t group = hash & groupMask;
+	uint8_t fingerprint = FINGERPRINT(hash);
 
-	for (;;)
+	for (uint32_t step = 1;; step++)
 	{
-		Entry * entry = &table->entries[index];
+		const uint8_t * control = &table->control[group * GROUP_SIZE];
+
+		for (uint64_t match = matchByte(control, fingerprint); match != 0; match &= match - 1)
+		{
+			ObjString * key = table->keys[group * GROUP_SIZE + firstLane(match)];
+			if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0)
+				return key;
+		}
 
-		if (entry->key == NULL)
+		// Keep probing past tombstones, only a group with an empty slot ends the chain.
+		if (matchByte(control, CONTROL_EMPTY) != 0)
 			return NULL;
-		if (entry->key->length == length &&
-			memcmp(entry->key->chars, chars, length) == 0)
-			return entry->key;
 
-		index = (index + 1) % table->capacity;
+		group = (group + step) & groupMask;
 	}
 }
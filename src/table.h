@@ -1,4 +1,3 @@
-
 #ifndef LOX_TABLE_H
 #define LOX_TABLE_H
 
@@ -6,21 +5,30 @@
 #include "value.h"
 
 
+// Keys and values live in arrays of their own, and each slot also has a control
+// byte in a third, dense array. A full slot's control byte holds 7 bits of its
+// key's hash, so a probe can check a whole group of slots in one cache line
+// and only reads a key when those bits match.
 typedef struct {
-	ObjString * key;
-	Value value;
-} Entry;
-
-typedef struct {
+	// Full slots plus tombstones, which both count towards the load.
 	int count;
+	int tombstones;
+	// Zero, or a power of two that is a whole number of groups.
 	int capacity;
-	Entry * entries;
+	uint8_t * control;
+	ObjString ** keys;
+	Value * values;
 } Table;
 
 
 void initTable(Table * table);
 void freeTable(Table * table);
 
+// Grows table up front so that it holds count entries without growing again.
+// Tombstones are included in count, a table that only fills up with them is
+// rebuilt at the size it has.
+void tableReserve(Table * table, int count);
+
 bool tableGet(Table * table, ObjString * key, Value * value);
 bool tableSet(Table * table, ObjString * key, Value value);
 bool tableDelete(Table * table, ObjString * key);
@@ -28,4 +36,6 @@ bool tableDelete(Table * table, ObjString * key);
 void tableAddAll(Table * from, Table * to);
 ObjString * tableFindString(Table * table, const char * chars, int length, uint32_t hash);
 
+void tableRemoveWhite(Table * table);
+
 #endif
@@ -0,0 +1,27 @@
+
+#if defined(LOX_PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+#endif
+
+#include "timer.h"
+
+
+uint64_t timerNanoseconds()
+{
+#if defined(LOX_PLATFORM_WINDOWS)
+	static LARGE_INTEGER frequency;
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
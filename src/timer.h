@@ -0,0 +1,9 @@
+#ifndef LOX_TIMER_H
+#define LOX_TIMER_H
+
+#include "common.h"
+
+// Monotonic wall clock in nanoseconds, only meaningful as a difference.
+uint64_t timerNanoseconds();
+
+#endif
@@ -0,0 +1,40 @@
+#include <stdio.h>
+
+#include "trace.h"
+
+#ifdef LOX_TRACE
+
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+int traceFlags = 0;
+
+static char traceBuffer[TRACE_BUFFER_SIZE];
+
+void initTrace(int flags)
+{
+	traceFlags = flags;
+
+	// Must run before anything is written to stderr.
+	if (flags != 0)
+		setvbuf(traceOut, traceBuffer, _IOFBF, TRACE_BUFFER_SIZE);
+}
+
+void flushTrace()
+{
+	if (traceFlags != 0)
+		fflush(traceOut);
+}
+
+#else
+
+void initTrace(int flags)
+{
+	if (flags != 0)
+		fprintf(stderr, "Tracing is not available in this build.\n");
+}
+
+void flushTrace()
+{
+}
+
+#endif
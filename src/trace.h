@@ -0,0 +1,41 @@
+#ifndef LOX_TRACE_H
+#define LOX_TRACE_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+
+typedef enum {
+	TRACE_FLAG_EXECUTION	= 1 << 0,	// --trace-exec
+	TRACE_FLAG_BYTECODE		= 1 << 1,	// --dump-bytecode
+	TRACE_FLAG_PARSE		= 1 << 2,	// --trace-parse
+	TRACE_FLAG_JIT			= 1 << 3,	// --trace-jit
+} TraceFlag;
+
+// Trace output shares stderr with error messages so the two stay in order,
+// but stderr is switched to a fully buffered stream while any tracing is on.
+#define traceOut stderr
+
+#ifdef LOX_TRACE
+
+extern int traceFlags;
+
+#define TRACING(flag)	((traceFlags & (flag)) != 0)
+#define TRACE(flag, ...) \
+	do { \
+		if (TRACING(flag)) \
+			fprintf(traceOut, __VA_ARGS__); \
+	} while (false)
+
+#else
+
+#define TRACING(flag)	false
+#define TRACE(flag, ...) do { } while (false)
+
+#endif
+
+void initTrace(int flags);
+void flushTrace();
+
+#endif
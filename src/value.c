@@ -8,6 +8,18 @@
 
 bool valuesEqual(Value a, Value b)
 {
+#ifdef LOX_NAN_BOXING
+	// Numbers still need a floating point compare so that NaN != NaN.
+	if (IS_NUMBER(a) && IS_NUMBER(b))
+		return AS_NUMBER(a) == AS_NUMBER(b);
+
+#ifdef LOX_LAZY_INTERN
+	if (a != b && IS_STRING(a) && IS_STRING(b))
+		return stringsEqual(AS_STRING(a), AS_STRING(b));
+#endif
+
+	return a == b;
+#else
 	if (a.type != b.type)
 		return false;
 
@@ -16,23 +28,37 @@ bool valuesEqual(Value a, Value b)
 		case VAL_BOOL: 		return AS_BOOL(a) == AS_BOOL(b);
 		case VAL_NIL:  		return true;
 		case VAL_NUMBER:	return AS_NUMBER(a) == AS_NUMBER(b);
+#ifdef LOX_LAZY_INTERN
+		case VAL_OBJ:
+			if (IS_STRING(a) && IS_STRING(b))
+				return stringsEqual(AS_STRING(a), AS_STRING(b));
+			return AS_OBJ(a) == AS_OBJ(b);
+#else
 		case VAL_OBJ:		return AS_OBJ(a) == AS_OBJ(b);
+#endif
 	}
 
 	return false;
+#endif
 }
 
 void initValueArray(ValueArray * array)
+{
+	initValueArrayInArena(array, NULL);
+}
+
+void initValueArrayInArena(ValueArray * array, Arena * arena)
 {
 	array->count = 0;
 	array->capacity = 0;
 	array->values = NULL;
+	array->arena = arena;
 }
 
 void freeValueArray(ValueArray * array)
 {
-	FREE_ARRAY(Value, array->values, array->capacity);
-	initValueArray(array);
+	ARENA_FREE_ARRAY(array->arena, Value, array->values, array->capacity, MEM_CONSTANTS);
+	initValueArrayInArena(array, array->arena);
 }
 
 void writeValueArray(ValueArray * array, Value value)
@@ -41,7 +67,7 @@ void writeValueArray(ValueArray * array, Value value)
 	{
 		int oldCapacity = array->capacity;
 		array->capacity = GROW_CAPACITY(oldCapacity);
-		array->values = GROW_ARRAY(array->values, Value, oldCapacity, array->capacity);
+		array->values = ARENA_GROW_ARRAY(array->arena, array->values, Value, oldCapacity, array->capacity, MEM_CONSTANTS);
 	}
 
 	array->values[array->count] = value;
@@ -50,11 +76,27 @@ void writeValueArray(ValueArray * array, Value value)
 
 void printValue(Value value)
 {
+	fprintValue(stdout, value);
+}
+
+void fprintValue(FILE * out, Value value)
+{
+#ifdef LOX_NAN_BOXING
+	if (IS_BOOL(value))
+		fprintf(out, AS_BOOL(value) ? "true" : "false");
+	else if (IS_NIL(value))
+		fprintf(out, "nil");
+	else if (IS_NUMBER(value))
+		fprintf(out, "%g", AS_NUMBER(value));
+	else if (IS_OBJ(value))
+		fprintObject(out, value);
+#else
 	switch (value.type)
 	{
-		case VAL_BOOL:		printf(AS_BOOL(value) ? "true" : "false"); break;
-		case VAL_NIL:		printf("nil"); break;
-		case VAL_NUMBER:	printf("%g", AS_NUMBER(value)); break;
-		case VAL_OBJ:		printObject(value); break;
+		case VAL_BOOL:		fprintf(out, AS_BOOL(value) ? "true" : "false"); break;
+		case VAL_NIL:		fprintf(out, "nil"); break;
+		case VAL_NUMBER:	fprintf(out, "%g", AS_NUMBER(value)); break;
+		case VAL_OBJ:		fprintObject(out, value); break;
 	}
+#endif
 }
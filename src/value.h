@@ -2,11 +2,63 @@
 #ifndef LOX_VALUE_H
 #define LOX_VALUE_H
 
+#include <stdio.h>
+#include <string.h>
+
 #include "common.h"
 
 
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
+typedef struct sArena Arena;
+
+#ifdef LOX_NAN_BOXING
+
+// A Value is a single 64-bit word. Doubles are stored as-is, everything else
+// lives inside the payload of a quiet NaN. Singletons use the low tag bits and
+// object pointers set the sign bit on top of the quiet NaN pattern.
+
+#define SIGN_BIT	((uint64_t)0x8000000000000000)
+#define QNAN		((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL		1 // 01
+#define TAG_FALSE	2 // 10
+#define TAG_TRUE	3 // 11
+
+typedef uint64_t Value;
+
+#define FALSE_VAL			((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL			((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(value)		(((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)		((value) == NIL_VAL)
+#define IS_NUMBER(value)	(((value) & QNAN) != QNAN)
+#define IS_OBJ(value)		(((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)		((value) == TRUE_VAL)
+#define AS_NUMBER(value)	valueToNum(value)
+#define AS_OBJ(value)		((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(value)		((value) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL				((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(value)	numToValue(value)
+#define OBJ_VAL(value)		((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(value)))
+
+static inline double valueToNum(Value value)
+{
+	double num;
+	memcpy(&num, &value, sizeof(Value));
+	return num;
+}
+
+static inline Value numToValue(double num)
+{
+	Value value;
+	memcpy(&value, &num, sizeof(double));
+	return value;
+}
+
+#else
 
 typedef enum {
 	VAL_BOOL,
@@ -40,6 +92,8 @@ typedef struct {
 #define NUMBER_VAL(value)	((Value){ VAL_NUMBER, { .number = (value) }})
 #define OBJ_VAL(value)		((Value){ VAL_OBJ, { .obj = (Obj *)(value) }})
 
+#endif
+
 
 bool valuesEqual(Value a, Value b);
 
@@ -47,13 +101,16 @@ typedef struct {
 	int count;
 	int capacity;
 	Value * values;
+	Arena * arena;
 } ValueArray;
 
 
 void initValueArray(ValueArray * array);
+void initValueArrayInArena(ValueArray * array, Arena * arena);
 void freeValueArray(ValueArray * array);
 void writeValueArray(ValueArray * array, Value value);
 
 void printValue(Value value);
+void fprintValue(FILE * out, Value value);
 
 #endif
\ No newline at end of file
@@ -1,20 +1,38 @@
 
+#if !defined(LOX_PLATFORM_WINDOWS)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "object.h"
 #include "memory.h"
+#include "cache.h"
 #include "compiler.h"
 #include "debug.h"
+#ifdef LOX_JIT
+#include "jit.h"
+#endif
+#include "trace.h"
 #include "vm.h"
 
-VM vm;
+#if defined(LOX_PLATFORM_WINDOWS)
+#define lockFile(file) _lock_file(file)
+#define unlockFile(file) _unlock_file(file)
+#else
+#define lockFile(file) flockfile(file)
+#define unlockFile(file) funlockfile(file)
+#endif
+
+LOX_THREAD_LOCAL VM * vm = NULL;
 
 static void resetStack()
 {
-	vm.stackTop = vm.stack;
+	vm->stackTop = vm->stack;
 }
 
 static void runtimeError(const char * format, ...)
@@ -25,39 +43,152 @@ static void runtimeError(const char * format, ...)
 	va_end(args);
 	fputs("\n", stderr);
 
-	size_t instruction = vm.ip - vm.chunk->code;
-	fprintf(stderr, "[line %d] in script\n", vm.chunk->lines[instruction]);
+	// ip has already moved past the instruction that failed.
+	size_t instruction = vm->ip - vm->chunk->code - 1;
+	fprintf(stderr, "[line %d] in script\n", getLine(vm->chunk, (int)instruction));
 	resetStack();
 }
 
-void initVM()
+// Prints what a chunk returns on a line of its own. Any number of VMs can share
+// stdout, so it stays locked until the line is complete.
+static void printResult(Value value)
 {
+	lockFile(stdout);
+	printValue(value);
+	printf("\n");
+	unlockFile(stdout);
+}
+
+// Makes room for count more values above stackTop. Anything holding pointers
+// into the stack has to reload them afterwards.
+static void reserveStack(int count)
+{
+	int depth = (int)(vm->stackTop - vm->stack);
+	if (depth + count <= vm->stackCapacity)
+		return;
+
+	int oldCapacity = vm->stackCapacity;
+	while (vm->stackCapacity < depth + count)
+		vm->stackCapacity = GROW_CAPACITY(vm->stackCapacity);
+
+	// push() grows the stack before the value it pushes is rooted, so this
+	// must not collect.
+	vm->stack = (Value *)reallocateNoGC(vm->stack, sizeof(Value) * oldCapacity, sizeof(Value) * vm->stackCapacity, MEM_STACK);
+	vm->stackTop = vm->stack + depth;
+}
+
+static void initVM()
+{
+	initHeapStats(&vm->heap);
+	vm->stack = NULL;
+	vm->stackCapacity = 0;
 	resetStack();
-	vm.objects = NULL;
-	initTable(&vm.strings);
+	vm->chunk = NULL;
+	vm->objects = NULL;
+
+	vm->nextGC = GC_INITIAL_THRESHOLD;
+	vm->grayCount = 0;
+	vm->grayCapacity = 0;
+	vm->grayStack = NULL;
+	vm->smallStrings = NULL;
+
+#ifdef LOX_GC_GENERATIONAL
+	vm->youngObjects = NULL;
+	vm->nurseryBytes = 0;
+	vm->minorCollection = false;
+	vm->rememberedCount = 0;
+	vm->rememberedCapacity = 0;
+	vm->remembered = NULL;
+#endif
+
+	initTable(&vm->strings);
+	vm->sharedStrings = NULL;
+	initArena(&vm->compileArena);
+	vm->compileBytes = 0;
+	initChunk(&vm->session);
+	for (int i = 0; i < HOT_LINE_COUNT; i++)
+	{
+		vm->hotLines[i].seen = 0;
+		vm->hotLines[i].hash = 0;
+		vm->hotLines[i].source = NULL;
+		initChunk(&vm->hotLines[i].chunk);
+	}
+	vm->foldConstants = true;
+
+#ifdef LOX_BENCH
+	vm->instructionCount = 0;
+#endif
+
+#ifdef LOX_PROFILE
+	initProfile(&vm->profile);
+#endif
 }
 
-void freeVM()
+static void emptyHotLine(HotLine * hot)
 {
-	freeTable(&vm.strings);
+	freeChunk(&hot->chunk);
+	free(hot->source);
+	hot->source = NULL;
+}
+
+static void releaseVM()
+{
+#ifdef LOX_PROFILE
+	printProfile(&vm->profile, stderr);
+	freeProfile(&vm->profile);
+#endif
+
+	freeChunk(&vm->session);
+	for (int i = 0; i < HOT_LINE_COUNT; i++)
+		emptyHotLine(&vm->hotLines[i]);
+	freeTable(&vm->strings);
 	freeObjects();
+	freeArena(&vm->compileArena);
+
+	FREE_ARRAY(Value, vm->stack, vm->stackCapacity, MEM_STACK);
+	vm->stack = NULL;
+	vm->stackCapacity = 0;
+	resetStack();
 }
 
-void push(Value value)
+VM * bindVM(VM * instance)
 {
-	*vm.stackTop = value;
-	vm.stackTop++;
+	VM * previous = vm;
+	vm = instance;
+	return previous;
 }
 
-Value pop()
+VM * newVM()
 {
-	vm.stackTop--;
-	return *vm.stackTop;
+	VM * instance = (VM *)malloc(sizeof(VM));
+	if (instance == NULL)
+		return NULL;
+
+	VM * previous = bindVM(instance);
+	initVM();
+	bindVM(previous);
+	return instance;
 }
 
-static Value peek(int distance)
+void freeVM(VM * instance)
+{
+	VM * previous = bindVM(instance);
+	releaseVM();
+	bindVM(previous == instance ? NULL : previous);
+	free(instance);
+}
+
+void push(Value value)
 {
-	return vm.stackTop[-1 - distance];
+	reserveStack(1);
+	*vm->stackTop = value;
+	vm->stackTop++;
+}
+
+Value pop()
+{
+	vm->stackTop--;
+	return *vm->stackTop;
 }
 
 static bool isFalsey(Value value)
@@ -65,150 +196,728 @@ static bool isFalsey(Value value)
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+#ifdef LOX_REGISTER_VM
+// Runs the register code of vm->chunk in the frame starting base values into
+// the stack. Anything that allocates can move the stack, so the frame pointer
+// is reloaded after it.
+static InterpretResult runRegisters(int base)
 {
-	ObjString * b = AS_STRING(pop());
-	ObjString * a  =AS_STRING(pop());
+	Chunk * chunk = vm->chunk;
+	RegisterInstruction * ip = chunk->registerCode;
+	RegisterInstruction * instruction;
+	Value * frame = vm->stack + base;
+
+#ifdef LOX_BENCH
+	uint64_t executed = 0;
+#define COUNT_INSTRUCTION() (executed++)
+#define STORE_COUNT() (vm->instructionCount += executed)
+#else
+#define COUNT_INSTRUCTION() do { } while (false)
+#define STORE_COUNT() do { } while (false)
+#endif
 
-	int length = a->length + b->length;
-	char * chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
+#define RELOAD_FRAME() (frame = vm->stack + base)
 
-	ObjString * result = takeString(chars, length);
+#define DST		(frame[instruction->dst])
+#define A		(frame[instruction->a])
+#define B		(frame[instruction->b])
+
+// Errors are reported like run() does, with ip just past the stack opcode.
+#define RUNTIME_ERROR(message) \
+	do { \
+		vm->ip = chunk->code + instruction->offset + 1; \
+		STORE_COUNT(); \
+		runtimeError(message); \
+		return INTERPRET_RUNTIME_ERROR; \
+	} while (false)
+
+#define BINARY_OP(valueType, op) \
+	do { \
+		if (!IS_NUMBER(A) || !IS_NUMBER(B)) \
+			RUNTIME_ERROR("Operands must be numbers."); \
+		\
+		DST = valueType(AS_NUMBER(A) op AS_NUMBER(B)); \
+	} while (false)
+
+// Equality compares ropes through their flattened strings, which replace them
+// in the operand slots.
+#define FLATTEN_OPERANDS() \
+	do { \
+		if (IS_ROPE(A)) \
+		{ \
+			ObjString * flat = flattenString(AS_OBJ(A)); \
+			RELOAD_FRAME(); \
+			A = OBJ_VAL(flat); \
+		} \
+		if (IS_ROPE(B)) \
+		{ \
+			ObjString * flat = flattenString(AS_OBJ(B)); \
+			RELOAD_FRAME(); \
+			B = OBJ_VAL(flat); \
+		} \
+	} while (false)
+
+#ifdef LOX_TRACE
+#define TRACE_EXECUTION() \
+	do { \
+		if (TRACING(TRACE_FLAG_EXECUTION)) \
+			dissassembleRegisterInstruction(chunk, (int)(ip - chunk->registerCode)); \
+	} while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+
+#ifdef LOX_COMPUTED_GOTO
+	static void * dispatchTable[REG_COUNT] = {
+#define REGISTER_OPCODE_LABEL(name) &&LABEL_##name,
+		REGISTER_OPCODE_LIST(REGISTER_OPCODE_LABEL)
+#undef REGISTER_OPCODE_LABEL
+	};
+
+#define DISPATCH() \
+	do { \
+		TRACE_EXECUTION(); \
+		COUNT_INSTRUCTION(); \
+		instruction = ip++; \
+		goto *dispatchTable[instruction->op]; \
+	} while (false)
+#define INTERPRET_LOOP	DISPATCH();
+#define CASE(name)		LABEL_##name
+#else
+#define DISPATCH()		goto dispatch
+#define INTERPRET_LOOP \
+	dispatch: \
+		TRACE_EXECUTION(); \
+		COUNT_INSTRUCTION(); \
+		instruction = ip++; \
+		switch (instruction->op)
+#define CASE(name)		case name
+#endif
+
+	INTERPRET_LOOP
+	{
+		CASE(REG_EQUAL):
+			FLATTEN_OPERANDS();
+			DST = BOOL_VAL(valuesEqual(A, B));
+			DISPATCH();
+
+		CASE(REG_NOT_EQUAL):
+			FLATTEN_OPERANDS();
+			DST = BOOL_VAL(!valuesEqual(A, B));
+			DISPATCH();
+
+		CASE(REG_GREATER):			BINARY_OP(BOOL_VAL, >); DISPATCH();
+		CASE(REG_GREATER_EQUAL):	BINARY_OP(BOOL_VAL, >=); DISPATCH();
+		CASE(REG_LESS):				BINARY_OP(BOOL_VAL, <); DISPATCH();
+		CASE(REG_LESS_EQUAL):		BINARY_OP(BOOL_VAL, <=); DISPATCH();
+
+		CASE(REG_ADD):
+			if (IS_NUMBER(A) && IS_NUMBER(B))
+			{
+				DST = NUMBER_VAL(AS_NUMBER(A) + AS_NUMBER(B));
+			}
+			else if (IS_ANY_STRING(A) && IS_ANY_STRING(B))
+			{
+				// Both operands stay in their slots, so they are rooted
+				// while the result is allocated.
+				Obj * result = concatenateRope(AS_OBJ(A), AS_OBJ(B));
+				RELOAD_FRAME();
+				DST = OBJ_VAL(result);
+			}
+			else
+			{
+				RUNTIME_ERROR("Operands must be two numbers or two strings.");
+			}
+			DISPATCH();
+
+		CASE(REG_SUBTRACT):	BINARY_OP(NUMBER_VAL, -); DISPATCH();
+		CASE(REG_MULTIPLY):	BINARY_OP(NUMBER_VAL, *); DISPATCH();
+		CASE(REG_DIVIDE):	BINARY_OP(NUMBER_VAL, /); DISPATCH();
+
+		CASE(REG_NOT):
+			DST = BOOL_VAL(isFalsey(A));
+			DISPATCH();
+
+		CASE(REG_NEGATE):
+			if (!IS_NUMBER(A))
+				RUNTIME_ERROR("Operand must be a number.");
+
+			DST = NUMBER_VAL(-AS_NUMBER(A));
+			DISPATCH();
+
+		CASE(REG_RETURN):
+			printResult(A);
+			STORE_COUNT();
+			return INTERPRET_OK;
+
+#ifndef LOX_COMPUTED_GOTO
+		default:
+			RUNTIME_ERROR("Unknown opcode.");
+#endif
+	}
+
+	return INTERPRET_RUNTIME_ERROR;
+
+#undef COUNT_INSTRUCTION
+#undef STORE_COUNT
+#undef RELOAD_FRAME
+#undef DST
+#undef A
+#undef B
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef FLATTEN_OPERANDS
+#undef TRACE_EXECUTION
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
+}
+#else
+static Value peek(int distance)
+{
+	return vm->stackTop[-1 - distance];
+}
+
+static void concatenate()
+{
+	// Leave the operands on the stack until the result exists so a collection
+	// during the allocation can't free them.
+	Obj * b = AS_OBJ(peek(0));
+	Obj * a = AS_OBJ(peek(1));
+
+	Obj * result = concatenateRope(a, b);
+	pop();
+	pop();
 	push(OBJ_VAL(result));
 }
 
+// Ropes compare equal through their interned, flattened strings. The operands
+// are flattened where they sit on the stack so they stay reachable.
+static void flattenOperands()
+{
+	for (int i = 0; i < 2; i++)
+	{
+		if (IS_ROPE(peek(i)))
+		{
+			ObjString * flat = flattenString(AS_OBJ(peek(i)));
+			vm->stackTop[-1 - i] = OBJ_VAL(flat);
+		}
+	}
+}
+
 static InterpretResult run()
 {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+	// The instruction and stack pointers live in locals for the whole loop so
+	// the compiler can keep them in registers. They are written back to the VM
+	// with STORE_FRAME() before anything that looks at vm->ip or vm->stackTop.
+	uint8_t * ip;
+	Value * sp;
+
+#ifdef LOX_BENCH
+	// Counted in a local too and folded into the VM with the frame.
+	uint64_t executed = 0;
+#define COUNT_INSTRUCTION() (executed++)
+#define STORE_COUNT() \
+	do { \
+		vm->instructionCount += executed; \
+		executed = 0; \
+	} while (false)
+#else
+#define COUNT_INSTRUCTION() do { } while (false)
+#define STORE_COUNT() do { } while (false)
+#endif
+
+#define LOAD_FRAME() \
+	do { \
+		ip = vm->ip; \
+		sp = vm->stackTop; \
+	} while (false)
+#define STORE_FRAME() \
+	do { \
+		vm->ip = ip; \
+		vm->stackTop = sp; \
+		STORE_COUNT(); \
+	} while (false)
+
+#define PUSH(value)	(*sp++ = (value))
+#define POP()		(*--sp)
+#define PEEK(distance)	(sp[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
 #define BINARY_OP(valueType, op) \
 	do { \
-		if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
 		{ \
+			STORE_FRAME(); \
 			runtimeError("Operands must be numbers."); \
 			return INTERPRET_RUNTIME_ERROR; \
 		} \
 		\
-		double b = AS_NUMBER(pop()); \
-		double a = AS_NUMBER(pop()); \
-		push(valueType(a op b)); \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		PUSH(valueType(a op b)); \
 	} while(false)
 
-	for (;;)
-	{
-#ifdef DEBUG_TRACE_EXECUTION
-		printf("          ");
-		for (Value * slot = vm.stack; slot < vm.stackTop; slot++)
-		{
-			printf("[ ");
-			printValue(*slot);
-			printf(" ]");
-		}
-		printf("\n");
+#ifdef LOX_TRACE
+#define TRACE_EXECUTION() \
+	do { \
+		if (TRACING(TRACE_FLAG_EXECUTION)) \
+		{ \
+			fprintf(traceOut, "          "); \
+			for (Value * slot = vm->stack; slot < sp; slot++) \
+			{ \
+				fprintf(traceOut, "[ "); \
+				fprintValue(traceOut, *slot); \
+				fprintf(traceOut, " ]"); \
+			} \
+			fprintf(traceOut, "\n"); \
+			dissassembleInstruction(vm->chunk, (int)(ip - vm->chunk->code)); \
+		} \
+	} while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+
+#define FLATTEN_OPERANDS() \
+	do { \
+		if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) \
+		{ \
+			STORE_FRAME(); \
+			flattenOperands(); \
+			LOAD_FRAME(); \
+		} \
+	} while (false)
 
-		dissassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+// Rewrites the instruction being executed to op.
+#define QUICKEN(op) \
+	do { \
+		if (!vm->chunk->readOnly) \
+			ip[-1] = (op); \
+	} while (false)
+
+#ifdef LOX_PROFILE
+#define PROFILE_INSTRUCTION() profileInstruction(&vm->profile, vm->chunk, (int)(ip - vm->chunk->code))
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
 #endif
 
-		uint8_t instruction = READ_BYTE();
+#ifdef LOX_COMPUTED_GOTO
+	static void * dispatchTable[OP_COUNT] = {
+#define OPCODE_LABEL(name, length, stackEffect) &&LABEL_##name,
+		OPCODE_LIST(OPCODE_LABEL)
+#undef OPCODE_LABEL
+	};
 
-		switch (instruction)
-		{
-			case OP_CONSTANT: {
-					Value constant = READ_CONSTANT();
-					push(constant);
-				}
-				break;
+#define DISPATCH() \
+	do { \
+		TRACE_EXECUTION(); \
+		COUNT_INSTRUCTION(); \
+		PROFILE_INSTRUCTION(); \
+		goto *dispatchTable[READ_BYTE()]; \
+	} while (false)
+#define INTERPRET_LOOP	DISPATCH();
+#define CASE(name)		LABEL_##name
+#else
+#define DISPATCH()		goto dispatch
+#define INTERPRET_LOOP \
+	dispatch: \
+		TRACE_EXECUTION(); \
+		COUNT_INSTRUCTION(); \
+		PROFILE_INSTRUCTION(); \
+		switch (READ_BYTE())
+#define CASE(name)		case name
+#endif
 
-			case OP_CONSTANT_LONG: {
-					int index = (*vm.ip++) << 8;
-					index = index | (*vm.ip++);
-					Value constant = vm.chunk->constants.values[index];
-					push(constant);
-				}
-				break;
-
-			case OP_NIL: push(NIL_VAL); break;
-			case OP_TRUE: push(BOOL_VAL(true)); break;
-			case OP_FALSE: push(BOOL_VAL(false)); break;
-			case OP_EQUAL: {
-					Value b = pop();
-					Value a = pop();
-					push(BOOL_VAL(valuesEqual(a, b)));
+	LOAD_FRAME();
+
+	INTERPRET_LOOP
+	{
+		CASE(OP_CONSTANT): {
+				Value constant = READ_CONSTANT();
+				PUSH(constant);
+			}
+			DISPATCH();
+
+		CASE(OP_CONSTANT_LONG): {
+				int index = (*ip++) << 16;
+				index = index | ((*ip++) << 8);
+				index = index | (*ip++);
+				Value constant = vm->chunk->constants.values[index];
+				PUSH(constant);
+			}
+			DISPATCH();
+
+		CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+		CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+		CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+		CASE(OP_EQUAL): {
+				FLATTEN_OPERANDS();
+				Value b = POP();
+				Value a = POP();
+				PUSH(BOOL_VAL(valuesEqual(a, b)));
+			}
+			DISPATCH();
+
+		CASE(OP_NOT_EQUAL): {
+				FLATTEN_OPERANDS();
+				Value b = POP();
+				Value a = POP();
+				PUSH(BOOL_VAL(!valuesEqual(a, b)));
+			}
+			DISPATCH();
+
+		CASE(OP_GREATER):		BINARY_OP(BOOL_VAL, >); DISPATCH();
+		CASE(OP_GREATER_EQUAL):	BINARY_OP(BOOL_VAL, >=); DISPATCH();
+		CASE(OP_LESS):			BINARY_OP(BOOL_VAL, <); DISPATCH();
+		CASE(OP_LESS_EQUAL):	BINARY_OP(BOOL_VAL, <=); DISPATCH();
+		// The generic OP_ADD rewrites itself to the variant for the operand
+		// types it sees, which goes back to OP_ADD when its guard fails.
+		CASE(OP_ADD):
+		genericAdd: {
+				if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1)))
+				{
+					QUICKEN(OP_ADD_STR);
+					STORE_FRAME();
+					concatenate();
+					LOAD_FRAME();
 				}
-				break;
-
-			case OP_GREATER:	BINARY_OP(BOOL_VAL, >); break;
-			case OP_LESS:		BINARY_OP(BOOL_VAL, <); break;
-			case OP_ADD: {
-					if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-					{
-						concatenate();
-					}
-					else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-					{
-						double b = AS_NUMBER(pop());
-						double a = AS_NUMBER(pop());
-						push(NUMBER_VAL(a + b));
-					}
-					else
-					{
-						runtimeError("Operands must be two numbers or two strings.");
-						return INTERPRET_RUNTIME_ERROR;
-					}
+				else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+				{
+					QUICKEN(OP_ADD_NUM);
+					double b = AS_NUMBER(POP());
+					double a = AS_NUMBER(POP());
+					PUSH(NUMBER_VAL(a + b));
 				}
-				break;
-
-			case OP_SUBTRACT: 	BINARY_OP(NUMBER_VAL, -); break;
-			case OP_MULTIPLY: 	BINARY_OP(NUMBER_VAL, *); break;
-			case OP_DIVIDE:   	BINARY_OP(NUMBER_VAL, /); break;
-			case OP_NOT:
-				push(BOOL_VAL(isFalsey(pop())));
-				break;
-
-			case OP_NEGATE:   
-				if (!IS_NUMBER(peek(0)))
+				else
 				{
-					runtimeError("Operand must be a number.");
+					STORE_FRAME();
+					runtimeError("Operands must be two numbers or two strings.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
+			}
+			DISPATCH();
 
-				push(NUMBER_VAL(-AS_NUMBER(pop())));
-				break;
-
-			case OP_RETURN: {
-					printValue(pop());
-					printf("\n");
-					return INTERPRET_OK;
+		CASE(OP_ADD_NUM): {
+				if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+				{
+					QUICKEN(OP_ADD);
+					goto genericAdd;
 				}
-				break;
-		}
+
+				double b = AS_NUMBER(POP());
+				double a = AS_NUMBER(POP());
+				PUSH(NUMBER_VAL(a + b));
+			}
+			DISPATCH();
+
+		CASE(OP_ADD_STR):
+			if (!IS_ANY_STRING(PEEK(0)) || !IS_ANY_STRING(PEEK(1)))
+			{
+				QUICKEN(OP_ADD);
+				goto genericAdd;
+			}
+
+			STORE_FRAME();
+			concatenate();
+			LOAD_FRAME();
+			DISPATCH();
+
+		CASE(OP_SUBTRACT): 	BINARY_OP(NUMBER_VAL, -); DISPATCH();
+		CASE(OP_MULTIPLY): 	BINARY_OP(NUMBER_VAL, *); DISPATCH();
+		CASE(OP_DIVIDE):   	BINARY_OP(NUMBER_VAL, /); DISPATCH();
+		CASE(OP_NOT):
+			PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+			DISPATCH();
+
+		CASE(OP_NEGATE):
+			if (!IS_NUMBER(PEEK(0)))
+			{
+				STORE_FRAME();
+				runtimeError("Operand must be a number.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+			DISPATCH();
+
+		CASE(OP_RETURN): {
+				printResult(POP());
+				STORE_FRAME();
+				return INTERPRET_OK;
+			}
+
+#ifndef LOX_COMPUTED_GOTO
+		default:
+			STORE_FRAME();
+			runtimeError("Unknown opcode.");
+			return INTERPRET_RUNTIME_ERROR;
+#endif
 	}
 
+	return INTERPRET_RUNTIME_ERROR;
+
+#undef QUICKEN
+#undef FLATTEN_OPERANDS
+#undef COUNT_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef STORE_COUNT
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef PUSH
+#undef POP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef BINARY_OP
+#undef TRACE_EXECUTION
+#undef DISPATCH
+#undef INTERPRET_LOOP
+#undef CASE
 }
 
+#ifdef LOX_JIT
+Value * nativeAdd(Value * sp, int offset)
+{
+	vm->stackTop = sp;
+
+	if (!IS_ANY_STRING(peek(0)) || !IS_ANY_STRING(peek(1)))
+	{
+		vm->ip = vm->chunk->code + offset + 1;
+		runtimeError("Operands must be two numbers or two strings.");
+		return NULL;
+	}
+
+	concatenate();
+	return vm->stackTop;
+}
+
+Value * nativeEqual(Value * sp, int negate)
+{
+	vm->stackTop = sp;
+	flattenOperands();
+
+	Value b = pop();
+	Value a = pop();
+	push(BOOL_VAL(valuesEqual(a, b) != (negate != 0)));
+	return vm->stackTop;
+}
+
+Value * nativeNot(Value * sp)
+{
+	sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+	return sp;
+}
 
-InterpretResult interpret(const char * source)
+// Runs the native code of the chunk as far as it goes and lets run() carry on
+// from the instruction it stopped at.
+static InterpretResult runNative()
+{
+	TRACE(TRACE_FLAG_JIT, "Running native code\n");
+
+	int resume = 0;
+	Value * sp = vm->chunk->native(vm->stackTop, &resume);
+	if (sp == NULL)
+		return INTERPRET_RUNTIME_ERROR;
+
+	vm->stackTop = sp;
+	vm->ip = vm->chunk->code + resume;
+	return run();
+}
+#endif
+#endif
+
+
+InterpretResult runChunk(Chunk * chunk)
+{
+#ifdef LOX_REGISTER_VM
+	// The frame goes on top of the stack: the constants the code loads, nil,
+	// true and false, followed by the registers. Registers start out as nil so
+	// the collector never sees garbage in them.
+	int base = (int)(vm->stackTop - vm->stack);
+	reserveStack(chunk->frameSize);
+
+	Value * frame = vm->stackTop;
+	for (int slot = 0; slot < chunk->frameConstantCount; slot++)
+		frame[slot] = chunk->constants.values[chunk->frameConstants[slot]];
+	for (int slot = FRAME_NIL(chunk); slot < chunk->frameSize; slot++)
+		frame[slot] = NIL_VAL;
+	frame[FRAME_TRUE(chunk)] = BOOL_VAL(true);
+	frame[FRAME_FALSE(chunk)] = BOOL_VAL(false);
+	vm->stackTop = frame + chunk->frameSize;
+#else
+	// The compiler worked out how deep the chunk can go, so run() never has to
+	// check for overflow.
+	reserveStack(chunk->maxStack);
+#endif
+
+	vm->chunk = chunk;
+	vm->ip = vm->chunk->code;
+
+#ifdef LOX_JIT
+	// Shared chunks are compiled by their pool, the count is not thread safe.
+	if (chunk->native == NULL && !chunk->readOnly && chunk->runs <= JIT_THRESHOLD && chunk->runs++ == JIT_THRESHOLD)
+	{
+		if (compileNative(chunk))
+			TRACE(TRACE_FLAG_JIT, "Compiled to native code after %d runs\n", JIT_THRESHOLD);
+	}
+#endif
+
+#ifdef LOX_PROFILE
+	beginProfileRun(&vm->profile, chunk);
+#endif
+
+#if defined(LOX_REGISTER_VM)
+	InterpretResult result = runRegisters(base);
+	vm->stackTop = vm->stack + base;
+#elif defined(LOX_JIT)
+	// Tracing shows every instruction, which native code does not.
+	bool useNative = chunk->native != NULL;
+#ifdef LOX_TRACE
+	if (TRACING(TRACE_FLAG_EXECUTION))
+		useNative = false;
+#endif
+	InterpretResult result = useNative ? runNative() : run();
+#else
+	InterpretResult result = run();
+#endif
+
+#ifdef LOX_PROFILE
+	endProfileRun(&vm->profile, chunk);
+#endif
+
+	vm->chunk = NULL;
+	return result;
+}
+
+static InterpretResult interpret(const char * source)
 {
 	Chunk chunk;
-	initChunk(&chunk);
+	initChunkInArena(&chunk, &vm->compileArena);
+
+	bool compiled = compile(source, &chunk);
+	vm->compileBytes = vm->compileArena.bytesAllocated;
+
+	InterpretResult result = compiled ? runChunk(&chunk) : INTERPRET_COMPILE_ERROR;
 
-	if (!compile(source, &chunk))
+	freeChunk(&chunk);
+	resetArena(&vm->compileArena);
+	return result;
+}
+
+// A session starts over once its pool holds this many constants, so it does not
+// grow forever on input that keeps bringing new literals.
+#define SESSION_MAX_CONSTANTS 4096
+
+// Replaces the line in hot with source, which still has to be compiled into its
+// chunk. Leaves the slot empty when there is no memory for the copy.
+static bool replaceHotLine(HotLine * hot, const char * source, uint64_t hash)
+{
+	emptyHotLine(hot);
+	hot->seen = 0;
+
+	size_t length = strlen(source);
+	hot->source = (char *)malloc(length + 1);
+	if (hot->source == NULL)
+		return false;
+
+	memcpy(hot->source, source, length + 1);
+	hot->hash = hash;
+	return true;
+}
+
+static InterpretResult interpretLine(const char * source)
+{
+	uint64_t hash = hashSource(source);
+	HotLine * hot = &vm->hotLines[hash % HOT_LINE_COUNT];
+
+	if (hot->source != NULL && hot->hash == hash && strcmp(hot->source, source) == 0)
+		return runChunk(&hot->chunk);
+
+	// A line only moves in the second time in a row it misses its slot, lines
+	// that come once go through the session and leave the slot alone.
+	if (hot->seen == hash && replaceHotLine(hot, source, hash))
 	{
-		freeChunk(&chunk);
+		if (compile(source, &hot->chunk))
+			return runChunk(&hot->chunk);
+
+		emptyHotLine(hot);
 		return INTERPRET_COMPILE_ERROR;
 	}
 
-	vm.chunk = &chunk;
-	vm.ip = vm.chunk->code;
+	hot->seen = hash;
 
-	InterpretResult result = run();
+	Chunk * chunk = &vm->session;
+
+	if (chunk->constants.count > SESSION_MAX_CONSTANTS)
+		freeChunk(chunk);
+
+	int constantCount = chunk->constants.count;
+	truncateChunk(chunk, 0);
+	chunk->maxStack = 0;
+
+	if (!compile(source, chunk))
+	{
+		truncateConstants(chunk, constantCount);
+		return INTERPRET_COMPILE_ERROR;
+	}
+
+	return runChunk(chunk);
+}
+
+static InterpretResult interpretCached(const char * source, const char * cachePath)
+{
+	Chunk chunk;
+	initChunkInArena(&chunk, &vm->compileArena);
+
+	uint64_t key = cacheKey(source, vm->foldConstants);
+	InterpretResult result = INTERPRET_OK;
+
+	if (loadChunk(cachePath, key, &chunk))
+	{
+		// The compiler dumps what it compiles, loaded chunks are dumped here.
+		if (TRACING(TRACE_FLAG_BYTECODE))
+			dumpChunk(&chunk);
+	}
+	else
+	{
+		bool compiled = compile(source, &chunk);
+		vm->compileBytes = vm->compileArena.bytesAllocated;
+
+		if (compiled)
+			saveChunk(cachePath, key, &chunk);
+		else
+			result = INTERPRET_COMPILE_ERROR;
+	}
+
+	if (result == INTERPRET_OK)
+		result = runChunk(&chunk);
 
 	freeChunk(&chunk);
+	resetArena(&vm->compileArena);
+	return result;
+}
+
+InterpretResult interpretIn(VM * instance, const char * source)
+{
+	VM * previous = bindVM(instance);
+	InterpretResult result = interpret(source);
+	bindVM(previous);
+	return result;
+}
+
+InterpretResult interpretLineIn(VM * instance, const char * source)
+{
+	VM * previous = bindVM(instance);
+	InterpretResult result = interpretLine(source);
+	bindVM(previous);
+	return result;
+}
+
+InterpretResult interpretCachedIn(VM * instance, const char * source, const char * cachePath)
+{
+	VM * previous = bindVM(instance);
+	InterpretResult result = interpretCached(source, cachePath);
+	bindVM(previous);
 	return result;
 }
@@ -3,38 +3,120 @@
 #define LOX_VM_H
 
 #include "chunk.h"
+#ifdef LOX_PROFILE
+#include "profile.h"
+#endif
 #include "value.h"
 #include "table.h"
 
 
-#define STACK_MAX 256
-
-
 typedef enum {
 	INTERPRET_OK,
 	INTERPRET_COMPILE_ERROR,
 	INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
+// Lines that come back during a session keep a chunk of their own, so they are
+// not compiled again and their runs add up towards the JIT threshold. Each line
+// has one slot, picked by the hash of its source.
+#define HOT_LINE_COUNT 64
+
+typedef struct {
+	// The last line that missed the slot. Missing it again moves it in.
+	uint64_t seen;
+	// The line chunk was compiled from and its hash. source is NULL while the
+	// slot is empty.
+	uint64_t hash;
+	char * source;
+	Chunk chunk;
+} HotLine;
+
 typedef struct {
 	Chunk * chunk;
 	uint8_t * ip;
-	Value stack[STACK_MAX];
+	// The operand stack grows to fit the maxStack of each chunk it runs.
+	Value * stack;
 	Value * stackTop;
+	int stackCapacity;
 	Table strings;
+	// Frozen strings of the shared chunk being run, looked up before strings
+	// so constants and runtime strings intern to the same objects.
+	Table * sharedStrings;
 
 	Obj * objects;
+
+	// Collector state. Bytes in use are tracked by heap.bytesAllocated.
+	size_t nextGC;
+	int grayCount;
+	int grayCapacity;
+	Obj ** grayStack;
+
+	// Recycled blocks for strings of up to SMALL_STRING_LENGTH characters.
+	Obj * smallStrings;
+
+#ifdef LOX_GC_GENERATIONAL
+	// Objects allocated since the last collection, and the bytes they took.
+	Obj * youngObjects;
+	size_t nurseryBytes;
+	bool minorCollection;
+
+	// Old objects that may reference young ones, see rememberObject().
+	int rememberedCount;
+	int rememberedCapacity;
+	Obj ** remembered;
+#endif
+
+	// Backing memory for the chunk compiled by interpret(), released wholesale
+	// once it has run. compileBytes is what the last compile drew from it.
+	Arena compileArena;
+	size_t compileBytes;
+
+	// Reused by interpretLineIn() from one line to the next, so literals seen
+	// on earlier lines keep their constants.
+	Chunk session;
+	HotLine hotLines[HOT_LINE_COUNT];
+
+	// Whether the compiler folds operators over literals. On by default.
+	bool foldConstants;
+
+	HeapStats heap;
+
+#ifdef LOX_BENCH
+	uint64_t instructionCount;
+#endif
+
+#ifdef LOX_PROFILE
+	Profile profile;
+#endif
 } VM;
 
 
-extern VM vm;
+// The VM bound to the calling thread. interpretIn() and friends bind their
+// instance for the duration of the call, so every VM can be driven from its
+// own thread. A VM must only be used by one thread at a time.
+extern LOX_THREAD_LOCAL VM * vm;
+
+
+VM * newVM();
+void freeVM(VM * instance);
+
+// Makes instance the VM of the calling thread and returns the previous one.
+VM * bindVM(VM * instance);
+
 
+InterpretResult interpretIn(VM * instance, const char * source);
 
-void initVM();
-void freeVM();
+// Like interpretIn(), for one line of an interactive session or one expression
+// of a batch. The code of the previous line is dropped but its constants are
+// kept for the next ones. A line seen before may run from its hot line chunk.
+InterpretResult interpretLineIn(VM * instance, const char * source);
 
+// Like interpretIn(), but runs the chunk stored at cachePath when it was
+// compiled from the same source, and stores the compiled chunk there otherwise.
+InterpretResult interpretCachedIn(VM * instance, const char * source, const char * cachePath);
 
-InterpretResult interpret(const char * source);
+// Runs a chunk compiled by the bound VM, or one shared with it read-only.
+InterpretResult runChunk(Chunk * chunk);
 
 void push(Value value);
 Value pop();
@@ -0,0 +1,93 @@
+@echo off
+setlocal enableextensions enabledelayedexpansion
+
+rem Builds the test configuration, a debug build with the JIT, and runs every
+rem test in test\. Each test writes bin\name.out and bin\name.err, which have to
+rem match test\name.out and test\name.err, or those of the test named second
+rem when two runs must agree.
+
+call build test
+
+set failed=0
+
+rem Lines that keep coming back in a batch are compiled to native code once
+rem they are hot, and from then on run natively, runtime errors included.
+bin\lox.exe --no-fold --batch --trace-jit < test\jit.txt > bin\jit.out 2> bin\jit.err
+call :compare jit
+
+rem Every job runs the one chunk compiled into the pool, natively and at once.
+rem Without folding the jobs concatenate at runtime and intern their results
+rem next to the strings the pool froze.
+bin\lox.exe --jobs 4 --trace-jit test\jobs.lox > bin\jobs.out 2> bin\jobs.err
+call :compare jobs
+bin\lox.exe --no-fold --jobs 4 --trace-jit test\jobs.lox > bin\jobs-no-fold.out 2> bin\jobs-no-fold.err
+call :compare jobs-no-fold jobs
+
+rem Folding must not change what any expression prints, errors included.
+bin\lox.exe --batch < test\fold.txt > bin\fold.out 2> bin\fold.err
+call :compare fold
+bin\lox.exe --no-fold --batch < test\fold.txt > bin\no-fold.out 2> bin\no-fold.err
+call :compare no-fold fold
+
+rem A runtime error reports the line of the instruction that failed, found
+rem through the run-length encoded line table.
+bin\lox.exe test\lines.lox > bin\lines.out 2> bin\lines.err
+call :compare lines
+bin\lox.exe --no-fold test\lines.lox > bin\lines-no-fold.out 2> bin\lines-no-fold.err
+call :compare lines-no-fold lines
+
+rem Past 256 constants the compiler switches to OP_CONSTANT_LONG, which only
+rem happens with folding off.
+bin\lox.exe --no-fold test\constants.lox > bin\constants.out 2> bin\constants.err
+call :compare constants
+bin\lox.exe test\constants.lox > bin\constants-fold.out 2> bin\constants-fold.err
+call :compare constants-fold constants
+
+rem Concatenations of 64 characters and more make ropes at runtime, which have
+rem to print and compare like the strings folding makes.
+bin\lox.exe --no-fold --batch < test\ropes.txt > bin\ropes.out 2> bin\ropes.err
+call :compare ropes
+bin\lox.exe --batch < test\ropes.txt > bin\ropes-fold.out 2> bin\ropes-fold.err
+call :compare ropes-fold ropes
+
+rem The first run compiles and stores the cache, the second runs what it
+rem loads, and both dump the same code. Without folding the cache is not used.
+rem A cache whose constant was changed after it was written is compiled again.
+copy /y test\cache.lox bin\cache.lox >nul
+if exist bin\cache.loxc del bin\cache.loxc
+bin\lox.exe --cache --dump-bytecode bin\cache.lox > bin\cache.out 2> bin\cache.err
+call :compare cache
+if not exist bin\cache.loxc (
+	echo FAILED: cache.loxc
+	set failed=1
+)
+bin\lox.exe --cache --dump-bytecode bin\cache.lox > bin\cache-loaded.out 2> bin\cache-loaded.err
+call :compare cache-loaded cache
+bin\lox.exe --no-fold --cache --dump-bytecode bin\cache.lox > bin\cache-no-fold.out 2> bin\cache-no-fold.err
+call :compare cache-no-fold
+copy /y test\corrupt.loxc bin\cache.loxc >nul
+bin\lox.exe --cache --dump-bytecode bin\cache.lox > bin\cache-corrupt.out 2> bin\cache-corrupt.err
+call :compare cache-corrupt cache
+
+rem Sized frames, with and without a newline after the source.
+bin\lox.exe --batch-sized < test\sized.txt > bin\sized.out 2> bin\sized.err
+call :compare sized
+
+if !failed!==0 (
+	echo All tests passed.
+) else (
+	exit /b 1
+)
+goto :eof
+
+:compare
+set expected=%1
+if not "%2"=="" set expected=%2
+for %%s in (out err) do (
+	fc bin\%1.%%s test\!expected!.%%s >nul
+	if errorlevel 1 (
+		echo FAILED: %1.%%s
+		set failed=1
+	)
+)
+goto :eof